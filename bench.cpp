@@ -0,0 +1,716 @@
+/*
+Workloads that call the filesystem operations directly, without FUSE or a
+mount, on a freshly formatted disk. "make bench" builds and runs it; pick a
+backend with DISK_BACKEND, e.g. DISK_MEMORY to leave the device out.
+
+    ./fsbench [-s scale] [-v] [workload...]
+
+Workloads: remount small deep sequential random wide, all of them by default.
+-s multiplies the operation counts, -v prints the /.fsstats table at the end.
+Every phase reports operations per second, latency percentiles and the disk
+blocks read and written per operation, readahead and commits included.
+
+Everything read back is checked against what was written, and a wrong result
+stops the run like a failed operation. remount runs first, in processes of its
+own: one formats the disk and dies, the next mounts it, fills it, syncs and
+dies without a checkpoint, the last mounts it, replaying the journal, and
+checks every file and name. Backends that keep nothing between processes skip
+it.
+*/
+
+#include "fs.cpp"
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+namespace bench
+{
+    using Latencies = std::vector<uint64_t, malloc_allocator<uint64_t>>;
+
+    double scale = 1;
+
+    uint64_t now()
+    {
+        timespec time;
+        clock_gettime(CLOCK_MONOTONIC, &time);
+        return uint64_t(time.tv_sec) * 1000000000 + time.tv_nsec;
+    }
+
+    int count(int base)
+    {
+        return std::max(1, int(base * scale));
+    }
+
+    // Stops the run, a benchmark of failing operations measures nothing
+    void check(long ret, const char *what, const char *path)
+    {
+        if (ret >= 0)
+            return;
+        fprintf(stderr, "%s %s: %s\n", what, path, strerror(-ret));
+        exit(1);
+    }
+
+    // Stops the run on a result that differs from what was written
+    void expect(bool ok, const char *what, const char *path)
+    {
+        if (ok)
+            return;
+        fprintf(stderr, "%s %s: wrong result\n", what, path);
+        exit(1);
+    }
+
+    // The bytes at offset of a file written with seed, each block its own, so
+    // a block read from the wrong place or an older write shows; seed 0 is a hole
+    void pattern(char *data, size_t size, uint64_t seed, off_t offset)
+    {
+        if (seed == 0)
+        {
+            memset(data, 0, size);
+            return;
+        }
+        for (size_t i = 0; i < size; i++)
+        {
+            uint64_t at = offset + i;
+            data[i] = char(seed * 0x9e3779b1 + at * 7 + (at / BLOCK_SIZE) * 13);
+        }
+    }
+
+    // Whether data holds what pattern puts there
+    bool matches(const char *data, size_t size, uint64_t seed, off_t offset)
+    {
+        char expected[BLOCK_SIZE];
+        for (size_t done = 0; done < size; done += sizeof(expected))
+        {
+            size_t length = std::min(size - done, sizeof(expected));
+            pattern(expected, length, seed, offset + done);
+            if (memcmp(data + done, expected, length))
+                return false;
+        }
+        return true;
+    }
+
+    uint64_t random()
+    {
+        static uint64_t state = 0x9e3779b97f4a7c15;
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+
+    // One line of the report: times every operation run through it
+    class Phase
+    {
+        const char *name;
+        Latencies latencies;
+        uint64_t start, read, written;
+
+    public:
+        Phase(const char *name) : name(name)
+        {
+            Stats::transfers(read, written);
+            start = now();
+        }
+
+        template <typename Operation>
+        void operator()(Operation &&operation)
+        {
+            uint64_t begin = now();
+            operation();
+            latencies.push_back(now() - begin);
+        }
+
+        ~Phase()
+        {
+            uint64_t elapsed = now() - start, read_now, written_now;
+            Stats::transfers(read_now, written_now);
+            if (latencies.empty())
+                return;
+            std::sort(latencies.begin(), latencies.end());
+            double ops = latencies.size();
+            printf("%-22s %9zu %12.0f %9.1f %9.1f %9.2f %9.2f\n", name, latencies.size(), ops / (elapsed / 1e9),
+                   latencies[latencies.size() / 2] / 1e3, latencies[(latencies.size() * 99 - 1) / 100] / 1e3,
+                   (read_now - read) / ops, (written_now - written) / ops);
+        }
+    };
+
+    struct File
+    {
+        char path[64];
+        struct fuse_file_info fi = {};
+
+        File(const char *path)
+        {
+            strcpy(this->path, path);
+            fi.flags = O_RDWR;
+            check(fs_open(path, &fi), "open", path);
+        }
+
+        ~File()
+        {
+            check(fs_release(path, &fi), "release", path);
+        }
+    };
+
+    void sync(const char *name)
+    {
+        Phase phase(name);
+        phase([] { check(fs_fsync("/", 0, nullptr), "fsync", "/"); });
+    }
+
+    // Bytes read, the run stops on an error
+    int read_file(File &file, char *data, size_t size, off_t offset)
+    {
+        int ret = fs_read(file.path, data, size, offset, &file.fi);
+        check(ret, "read", file.path);
+        return ret;
+    }
+
+    // Number of entries a readdir from offset 0 hands out
+    int list(const char *path)
+    {
+        struct fuse_file_info fi = {};
+        check(fs_opendir(path, &fi), "opendir", path);
+        int entries = 0;
+        check(fs_readdir(path, &entries, [](void *entries, const char *, const struct stat *, off_t) {
+                  ++*static_cast<int *>(entries);
+                  return 0;
+              }, 0, &fi), "readdir", path);
+        fs_releasedir(path, &fi);
+        return entries;
+    }
+
+    // Many files of a few KiB: create, fill, stat, read back, delete
+    void small()
+    {
+        static constexpr int SIZE = 3000;
+        int files = count(5000);
+        char data[SIZE], path[64];
+        check(fs_mkdir("/small", DIRMODE), "mkdir", "/small");
+        {
+            Phase phase("small create");
+            for (int i = 0; i < files; i++)
+            {
+                sprintf(path, "/small/%d", i);
+                phase([&] { check(fs_mknod(path, REGMODE, 0), "mknod", path); });
+            }
+        }
+        {
+            Phase phase("small write+close");
+            for (int i = 0; i < files; i++)
+            {
+                sprintf(path, "/small/%d", i);
+                pattern(data, sizeof(data), i + 1, 0);
+                phase([&] {
+                    File file(path);
+                    check(fs_write(path, data, sizeof(data), 0, &file.fi), "write", path);
+                    check(fs_flush(path, &file.fi), "flush", path);
+                });
+            }
+        }
+        sync("small sync");
+        {
+            Phase phase("small getattr");
+            struct stat attr;
+            for (int i = 0; i < files; i++)
+            {
+                sprintf(path, "/small/%d", int(random() % files));
+                phase([&] { check(fs_getattr(path, &attr), "getattr", path); });
+                expect(S_ISREG(attr.st_mode) && attr.st_size == SIZE, "getattr", path);
+            }
+        }
+        {
+            Phase phase("small read");
+            for (int i = 0; i < files; i++)
+            {
+                sprintf(path, "/small/%d", i);
+                int done;
+                phase([&] {
+                    File file(path);
+                    done = read_file(file, data, sizeof(data), 0);
+                });
+                expect(done == SIZE && matches(data, SIZE, i + 1, 0), "read", path);
+            }
+        }
+        {
+            Phase phase("small unlink");
+            for (int i = 0; i < files; i++)
+            {
+                sprintf(path, "/small/%d", i);
+                phase([&] { check(fs_unlink(path), "unlink", path); });
+            }
+        }
+        check(fs_rmdir("/small"), "rmdir", "/small");
+        sync("small cleanup");
+    }
+
+    // Path resolution through a chain of directories, cached and after the
+    // path cache is invalidated
+    void deep()
+    {
+        static constexpr int DEPTH = 32;
+        int lookups = count(20000);
+        char path[DEPTH * 16 + 16] = "";
+        for (int i = 0; i < DEPTH; i++)
+        {
+            sprintf(path + strlen(path), "/level%d", i);
+            check(fs_mkdir(path, DIRMODE), "mkdir", path);
+        }
+        strcat(path, "/leaf");
+        check(fs_mknod(path, REGMODE, 0), "mknod", path);
+        int leaf = get_inode_from_path(path), found;
+        {
+            Phase phase("deep resolve");
+            for (int i = 0; i < lookups; i++)
+            {
+                phase([&] { found = get_inode_from_path(path); });
+                expect(found == leaf, "resolve", path);
+            }
+        }
+        {
+            Phase phase("deep resolve uncached");
+            for (int i = 0; i < lookups; i++)
+            {
+                DentryCache::invalidate_paths();
+                phase([&] { found = get_inode_from_path(path); });
+                expect(found == leaf, "resolve", path);
+            }
+        }
+        check(fs_unlink(path), "unlink", path);
+        for (*strrchr(path, '/') = 0; *path; *strrchr(path, '/') = 0)
+            check(fs_rmdir(path), "rmdir", path);
+        sync("deep cleanup");
+    }
+
+    // One large file written and read front to back in 128 KiB requests, as
+    // the kernel sends them
+    void sequential()
+    {
+        static constexpr int CHUNK = 128 * 1024;
+        int chunks = count(512);
+        auto data = static_cast<char *>(malloc(CHUNK));
+        check(fs_mknod("/sequential", REGMODE, 0), "mknod", "/sequential");
+        {
+            File file("/sequential");
+            Phase phase("sequential write 128K");
+            for (int i = 0; i < chunks; i++)
+            {
+                pattern(data, CHUNK, 1, off_t(i) * CHUNK);
+                phase([&] { check(fs_write(file.path, data, CHUNK, off_t(i) * CHUNK, &file.fi), "write", file.path); });
+            }
+            phase([&] { check(fs_flush(file.path, &file.fi), "flush", file.path); });
+        }
+        sync("sequential sync");
+        {
+            File file("/sequential");
+            Phase phase("sequential read 128K");
+            for (int i = 0; i < chunks; i++)
+            {
+                int done;
+                phase([&] { done = read_file(file, data, CHUNK, off_t(i) * CHUNK); });
+                expect(done == CHUNK && matches(data, CHUNK, 1, off_t(i) * CHUNK), "read", file.path);
+            }
+        }
+        check(fs_unlink("/sequential"), "unlink", "/sequential");
+        sync("sequential cleanup");
+        free(data);
+    }
+
+    // Aligned 4 KiB reads and overwrites at random offsets of a 32 MiB file,
+    // every write with its own contents, checked against a model of the file
+    void random_io()
+    {
+        static constexpr int SIZE = 32 << 20;
+        int ops = count(20000);
+        char block[BLOCK_SIZE];
+        std::vector<uint32_t, malloc_allocator<uint32_t>> seeds(SIZE / BLOCK_SIZE); // the write each block holds
+        auto read_random = [&](File &file, const char *name) {
+            Phase phase(name);
+            for (int i = 0; i < ops; i++)
+            {
+                int blockno = random() % (SIZE / BLOCK_SIZE), done;
+                off_t offset = off_t(blockno) * BLOCK_SIZE;
+                phase([&] { done = read_file(file, block, BLOCK_SIZE, offset); });
+                expect(done == BLOCK_SIZE && matches(block, BLOCK_SIZE, seeds[blockno], offset), "read", file.path);
+            }
+        };
+        check(fs_mknod("/random", REGMODE, 0), "mknod", "/random");
+        {
+            File file("/random");
+            check(fs_ftruncate(file.path, SIZE, &file.fi), "ftruncate", file.path);
+            read_random(file, "random read 4K");
+            {
+                Phase phase("random write 4K");
+                for (int i = 0; i < ops; i++)
+                {
+                    int blockno = random() % (SIZE / BLOCK_SIZE);
+                    off_t offset = off_t(blockno) * BLOCK_SIZE;
+                    seeds[blockno] = i + 1;
+                    pattern(block, BLOCK_SIZE, seeds[blockno], offset);
+                    phase([&] { check(fs_write(file.path, block, BLOCK_SIZE, offset, &file.fi), "write", file.path); });
+                }
+            }
+            read_random(file, "random reread 4K");
+        }
+        sync("random sync");
+        check(fs_unlink("/random"), "unlink", "/random");
+        sync("random cleanup");
+    }
+
+    // One directory with many entries: create, look up, list, delete
+    void wide()
+    {
+        int entries = count(20000);
+        char path[64];
+        check(fs_mkdir("/wide", DIRMODE), "mkdir", "/wide");
+        {
+            Phase phase("wide create");
+            for (int i = 0; i < entries; i++)
+            {
+                sprintf(path, "/wide/entry-%08d", i);
+                phase([&] { check(fs_mknod(path, REGMODE, 0), "mknod", path); });
+            }
+        }
+        sync("wide sync");
+        {
+            Phase phase("wide lookup");
+            struct stat attr;
+            for (int i = 0; i < entries; i++)
+            {
+                sprintf(path, "/wide/entry-%08d", int(random() % entries));
+                phase([&] { check(fs_getattr(path, &attr), "getattr", path); });
+                expect(S_ISREG(attr.st_mode), "getattr", path);
+            }
+        }
+        {
+            Phase phase("wide readdir");
+            for (int i = 0; i < 10; i++)
+                phase([&] {
+                    if (list("/wide") != entries)
+                        check(-EIO, "readdir", "/wide");
+                });
+        }
+        {
+            Phase phase("wide unlink");
+            for (int i = 0; i < entries; i++)
+            {
+                sprintf(path, "/wide/entry-%08d", i);
+                phase([&] { check(fs_unlink(path), "unlink", path); });
+            }
+        }
+        expect(list("/wide") == 0, "readdir", "/wide");
+        check(fs_rmdir("/wide"), "rmdir", "/wide");
+        sync("wide cleanup");
+    }
+
+    // What remount leaves on the disk: files inline, promoted to blocks,
+    // demoted back and refilled, some renamed within and across directories and
+    // some unlinked, a large file partly overwritten and cut at an odd size, and
+    // a directory past INDEX_THRESHOLD with a third of it removed, and a file
+    // unlinked while still open, which the next mount has to free
+    namespace crash
+    {
+        static constexpr int INLINE = 60, PROMOTED = 3 * BLOCK_SIZE + 100, DEMOTED = 40, REFILLED = 30;
+        int files, entries;
+        off_t large;
+
+        int size(int i)
+        {
+            static constexpr int sizes[] = {INLINE, PROMOTED, DEMOTED, REFILLED};
+            return sizes[i % 4];
+        }
+
+        bool unlinked(int i)
+        {
+            return i % 7 == 2;
+        }
+
+        // Where file i ends up
+        char *path(int i, char *path)
+        {
+            if (i % 5 == 0)
+                sprintf(path, "/r/sub/moved-%d", i);
+            else if (i % 5 == 1)
+                sprintf(path, "/r/renamed-%d", i);
+            else
+                sprintf(path, "/r/file-%d", i);
+            return path;
+        }
+
+        void write_file(const char *path, size_t size, uint64_t seed)
+        {
+            auto data = static_cast<char *>(malloc(size));
+            pattern(data, size, seed, 0);
+            File file(path);
+            check(fs_write(path, data, size, 0, &file.fi), "write", path);
+            check(fs_flush(path, &file.fi), "flush", path);
+            free(data);
+        }
+
+        void fill()
+        {
+            char path[64], moved[64];
+            check(fs_mkdir("/r", DIRMODE), "mkdir", "/r");
+            check(fs_mkdir("/r/sub", DIRMODE), "mkdir", "/r/sub");
+            {
+                Phase phase("remount files");
+                for (int i = 0; i < files; i++)
+                {
+                    sprintf(path, "/r/file-%d", i);
+                    phase([&] {
+                        check(fs_mknod(path, REGMODE, 0), "mknod", path);
+                        if (i % 4 == 0 || i % 4 == 1)
+                            write_file(path, INLINE, i + 1);
+                        if (i % 4 == 1 || i % 4 == 2)
+                            write_file(path, PROMOTED, i + 1);
+                        if (i % 4 == 2)
+                            check(fs_truncate(path, DEMOTED), "truncate", path);
+                        if (i % 4 == 3)
+                        {
+                            write_file(path, 2 * BLOCK_SIZE, i + 1);
+                            check(fs_truncate(path, 0), "truncate", path);
+                            write_file(path, REFILLED, i + 1);
+                        }
+                        if (strcmp(crash::path(i, moved), path))
+                            check(fs_rename(path, moved), "rename", path);
+                        if (unlinked(i))
+                            check(fs_unlink(moved), "unlink", moved);
+                    });
+                }
+            }
+            {
+                static constexpr int CHUNK = 128 * 1024;
+                auto data = static_cast<char *>(malloc(CHUNK));
+                check(fs_mknod("/r/large", REGMODE, 0), "mknod", "/r/large");
+                File file("/r/large");
+                Phase phase("remount large 128K");
+                for (off_t offset = 0; offset < large + 5000; offset += CHUNK)
+                {
+                    pattern(data, CHUNK, 1, offset);
+                    phase([&] { check(fs_write(file.path, data, CHUNK, offset, &file.fi), "write", file.path); });
+                }
+                pattern(data, 3 * BLOCK_SIZE, 2, 10 * BLOCK_SIZE);
+                phase([&] { check(fs_write(file.path, data, 3 * BLOCK_SIZE, 10 * BLOCK_SIZE, &file.fi), "write", file.path); });
+                phase([&] { check(fs_ftruncate(file.path, large, &file.fi), "ftruncate", file.path); });
+                free(data);
+            }
+            check(fs_mkdir("/r/wide", DIRMODE), "mkdir", "/r/wide");
+            {
+                Phase phase("remount wide");
+                for (int i = 0; i < entries; i++)
+                {
+                    sprintf(path, "/r/wide/entry-%08d", i);
+                    phase([&] { check(fs_mknod(path, REGMODE, 0), "mknod", path); });
+                }
+                for (int i = 0; i < entries; i += 3)
+                {
+                    sprintf(path, "/r/wide/entry-%08d", i);
+                    phase([&] { check(fs_unlink(path), "unlink", path); });
+                }
+            }
+            check(fs_mknod("/r/open", REGMODE, 0), "mknod", "/r/open");
+            write_file("/r/open", PROMOTED, 1);
+            static File open("/r/open"); // still open when the process dies
+            check(fs_unlink(open.path), "unlink", open.path);
+            sync("remount sync");
+        }
+
+        void verify()
+        {
+            char path[64], data[PROMOTED];
+            struct stat attr;
+            Phase phase("remount verify");
+            for (int i = 0; i < files; i++)
+            {
+                crash::path(i, path);
+                int ret;
+                phase([&] { ret = fs_getattr(path, &attr); });
+                if (unlinked(i))
+                {
+                    expect(ret == -ENOENT, "getattr", path);
+                    continue;
+                }
+                check(ret, "getattr", path);
+                expect(attr.st_size == size(i), "getattr", path);
+                File file(path);
+                expect(read_file(file, data, sizeof(data), 0) == size(i) && matches(data, size(i), i + 1, 0), "read", path);
+            }
+            sprintf(path, "/r/file-%d", 0);
+            expect(fs_getattr(path, &attr) == -ENOENT, "getattr", path); // renamed away
+            expect(fs_getattr("/r/open", &attr) == -ENOENT, "getattr", "/r/open");
+            {
+                check(fs_getattr("/r/large", &attr), "getattr", "/r/large");
+                expect(attr.st_size == large, "getattr", "/r/large");
+                File file("/r/large");
+                char block[BLOCK_SIZE];
+                for (off_t offset = 0; offset < large; offset += BLOCK_SIZE)
+                {
+                    int done = read_file(file, block, BLOCK_SIZE, offset), want = std::min<off_t>(BLOCK_SIZE, large - offset);
+                    bool overwritten = offset >= 10 * BLOCK_SIZE && offset < 13 * BLOCK_SIZE;
+                    expect(done == want && matches(block, want, overwritten ? 2 : 1, offset), "read", file.path);
+                }
+            }
+            for (int i = 0; i < entries; i++)
+            {
+                sprintf(path, "/r/wide/entry-%08d", i);
+                int ret;
+                phase([&] { ret = fs_getattr(path, &attr); });
+                expect(ret == (i % 3 == 0 ? -ENOENT : 0), "getattr", path);
+            }
+            expect(list("/r/wide") == entries - (entries + 2) / 3, "readdir", "/r/wide");
+        }
+
+        void remove()
+        {
+            char path[64];
+            for (int i = 0; i < files; i++)
+                if (!unlinked(i))
+                    check(fs_unlink(crash::path(i, path)), "unlink", path);
+            for (int i = 0; i < entries; i++)
+                if (i % 3)
+                {
+                    sprintf(path, "/r/wide/entry-%08d", i);
+                    check(fs_unlink(path), "unlink", path);
+                }
+            check(fs_unlink("/r/large"), "unlink", "/r/large");
+            check(fs_rmdir("/r/wide"), "rmdir", "/r/wide");
+            check(fs_rmdir("/r/sub"), "rmdir", "/r/sub");
+            check(fs_rmdir("/r"), "rmdir", "/r");
+            sync("remount cleanup");
+        }
+
+        // Runs body in a child process, false if it failed
+        template <typename Body>
+        bool child(Body &&body)
+        {
+            fflush(stdout);
+            pid_t pid = fork();
+            if (pid == 0)
+            {
+                body();
+                fflush(stdout);
+                _exit(0); // no atexit flush, so nothing reaches the disk but what was synced
+            }
+            int status;
+            return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        }
+    } // namespace crash
+
+    // Mounts the disk remount left in the last process, replaying its journal,
+    // false if the backend kept nothing
+    bool remount_disk()
+    {
+        check(disk_open() ? -EIO : 0, "open", "");
+        int err;
+        {
+            Phase phase("remount mount+replay");
+            phase([&] { err = Disk::mount(); });
+        }
+        if (err == ENODEV)
+            return false;
+        check(-err, "mount", "");
+        free_orphans();
+        return true;
+    }
+
+    // Formats a disk and crashes, mounts it in a new process and fills it, syncs
+    // and crashes again, then mounts it once more, replaying the journal, and
+    // checks everything; the free counts have to be those of the freshly
+    // formatted disk both right after the first crash and after removing it all
+    void remount()
+    {
+        crash::files = count(400);
+        crash::entries = std::max(count(3000), 2000); // past INDEX_THRESHOLD blocks whatever the scale
+        crash::large = off_t(count(64)) * 128 * 1024 + 5000;
+        // Shared with the processes: the free counts after mkfs, and whether a mount found nothing
+        auto shared = static_cast<uint64_t *>(mmap(nullptr, 3 * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+        check(shared == MAP_FAILED ? -ENOMEM : 0, "mmap", "");
+        auto formatted = [&] {
+            struct stat attr;
+            check(fs_getattr("/", &attr), "getattr", "/");
+            expect(S_ISDIR(attr.st_mode), "getattr", "/");
+            struct statvfs stat;
+            fs_statfs("/", &stat);
+            expect(stat.f_ffree == shared[0] && stat.f_bfree == shared[1], "statfs", "/");
+        };
+        bool ok = crash::child([&] {
+            if (disk_open() || mkfs())
+                check(-EIO, "mkfs", "");
+            struct statvfs stat;
+            fs_statfs("/", &stat);
+            shared[0] = stat.f_ffree;
+            shared[1] = stat.f_bfree;
+        });
+        ok = ok && crash::child([&] {
+            if ((shared[2] = !remount_disk()))
+                return;
+            formatted();
+            crash::fill();
+        });
+        ok = ok && (shared[2] || crash::child([&] {
+                        check(remount_disk() ? 0 : -ENODEV, "mount", "");
+                        crash::verify();
+                        crash::remove();
+                        formatted();
+                    }));
+        if (!ok)
+            exit(1);
+        if (shared[2])
+            printf("%-22s skipped, the disk kept nothing from the last process\n", "remount");
+        munmap(shared, 3 * sizeof(uint64_t));
+    }
+
+    struct Workload
+    {
+        const char *name;
+        void (*run)();
+        bool own_disk; // formats and mounts the disk in processes of its own
+    } workloads[] = {{"remount", remount, true}, {"small", small}, {"deep", deep}, {"sequential", sequential},
+                     {"random", random_io}, {"wide", wide}};
+} // namespace bench
+
+int main(int argc, char *argv[])
+{
+    bool verbose = false;
+    for (int option; (option = getopt(argc, argv, "s:v")) != -1;)
+    {
+        if (option == 's')
+            bench::scale = atof(optarg);
+        else if (option == 'v')
+            verbose = true;
+        else
+        {
+            fprintf(stderr, "usage: %s [-s scale] [-v] [workload...]\n", argv[0]);
+            return 2;
+        }
+    }
+    printf("%-22s %9s %12s %9s %9s %9s %9s\n", "phase", "ops", "ops/s", "p50_us", "p99_us", "reads/op", "writes/op");
+    bool formatted = false;
+    for (auto &&workload : bench::workloads)
+    {
+        bool chosen = optind == argc;
+        for (int i = optind; i < argc; i++)
+            chosen |= strcmp(argv[i], workload.name) == 0;
+        if (!chosen)
+            continue;
+        // Formatted once the first workload that shares this process's disk comes
+        if (!workload.own_disk && !formatted)
+        {
+            if (disk_open() || mkfs())
+            {
+                fprintf(stderr, "Can't format the virtual disk!\n");
+                return 1;
+            }
+            formatted = true;
+        }
+        workload.run();
+    }
+
+    if (verbose)
+    {
+        std::vector<char, malloc_allocator<char>> text;
+        Stats::snapshot(text);
+        printf("\n%.*s", int(text.size()), text.data());
+    }
+    return 0;
+}
@@ -2,58 +2,450 @@
 Filesystem Lab disigned and implemented by Liang Junkai,RUC
 */
 
+#define _XOPEN_SOURCE 500
+#define _DEFAULT_SOURCE // preadv/pwritev
+#define _GNU_SOURCE     // mremap
+#define _FILE_OFFSET_BITS 64
+
 #include "disk.h"
 #include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 char disk_prefix[256];
+static int disk_block_num = BLOCK_NUM;
 
-int disk_init()
+static int disk_range(int block_id, int count)
+{
+    return block_id < 0 || count < 0 || block_id > disk_block_num - count;
+}
+
+#if defined(DISK_MEMORY) || defined(DISK_IMAGE) || defined(DISK_MMAP)
+static size_t disk_bytes(int blocks)
+{
+    return (size_t)blocks * BLOCK_SIZE;
+}
+#endif
+
+int disk_blocks()
+{
+    return disk_block_num;
+}
+
+#ifndef DISK_MEMORY
+static int disk_locate(const char* name)
 {
     FILE* fp = fopen("fuse~", "r");
     if (fp == NULL)
         return 1;
     fscanf(fp, "%s", disk_prefix);
     fclose(fp);
-    strcpy(disk_prefix + strlen(disk_prefix) - 8, "vdisk/block");
+    strcpy(disk_prefix + strlen(disk_prefix) - 8, name);
+    return 0;
+}
+#endif
+
+#if defined(DISK_MEMORY)
+
+/*
+The disk is anonymous memory that lives as long as the process: the
+filesystem and its block cache run as usual, minus the device. Nothing
+persists, this is for benchmarks.
+*/
+#include <sys/mman.h>
+
+static char* disk_base = NULL;
+
+int disk_init()
+{
+    if (disk_base != NULL && munmap(disk_base, disk_bytes(disk_block_num)))
+        return 1;
+    disk_base = NULL;
+    void* base = mmap(NULL, disk_bytes(disk_block_num), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+        return 1;
+    disk_base = base;
+    return 0;
+}
+
+int disk_open()
+{
+    return disk_base == NULL ? disk_init() : 0;
+}
+
+int disk_read(int block_id, void* buffer)
+{
+    if (disk_range(block_id, 1) || disk_base == NULL)
+        return 1;
+    memcpy(buffer, disk_base + (size_t)block_id * BLOCK_SIZE, BLOCK_SIZE);
+    return 0;
+}
+
+int disk_write(int block_id, void* buffer)
+{
+    if (disk_range(block_id, 1) || disk_base == NULL)
+        return 1;
+    memcpy(disk_base + (size_t)block_id * BLOCK_SIZE, buffer, BLOCK_SIZE);
+    return 0;
+}
+
+int disk_readv(int block_id, const struct iovec* iov, int count)
+{
+    if (disk_range(block_id, count) || disk_base == NULL)
+        return 1;
+    for (int i = 0; i < count; ++i)
+        memcpy(iov[i].iov_base, disk_base + (size_t)(block_id + i) * BLOCK_SIZE, BLOCK_SIZE);
+    return 0;
+}
+
+int disk_writev(int block_id, const struct iovec* iov, int count)
+{
+    if (disk_range(block_id, count) || disk_base == NULL)
+        return 1;
+    for (int i = 0; i < count; ++i)
+        memcpy(disk_base + (size_t)(block_id + i) * BLOCK_SIZE, iov[i].iov_base, BLOCK_SIZE);
+    return 0;
+}
+
+// Not handed out as a mapping, so that reads go through the block cache
+void* disk_map()
+{
+    return NULL;
+}
+
+int disk_sync()
+{
+    return 0;
+}
+
+int disk_resize(int blocks)
+{
+    if (blocks < 1)
+        return 1;
+    if (disk_base != NULL) {
+        void* base = mremap(disk_base, disk_bytes(disk_block_num), disk_bytes(blocks), MREMAP_MAYMOVE);
+        if (base == MAP_FAILED)
+            return 1;
+        disk_base = base;
+    }
+    disk_block_num = blocks;
+    return 0;
+}
+
+#elif defined(DISK_IMAGE) || defined(DISK_MMAP)
+
+/*
+The whole disk is one flat image, kept open for the lifetime of the process and accessed with pread/pwrite, or through a
+shared mapping of the image when built with DISK_MMAP.
+*/
+
+static int disk_fd = -1;
+
+#ifdef DISK_MMAP
+#include <sys/mman.h>
+
+static char* disk_base = NULL;
+#endif
+
+static int disk_attach(int flags)
+{
+    if (disk_locate("vdisk/image"))
+        return 1;
+    disk_fd = open(disk_prefix, O_RDWR | O_CREAT | flags, 0644);
+    if (disk_fd < 0)
+        return 1;
+    // An existing image keeps its size, a new one gets the current block count;
+    // extending with ftruncate leaves the image sparse, blocks read as zero
+    struct stat st;
+    if (fstat(disk_fd, &st))
+        return 1;
+    if (st.st_size >= BLOCK_SIZE)
+        disk_block_num = st.st_size / BLOCK_SIZE;
+    else if (ftruncate(disk_fd, disk_bytes(disk_block_num)))
+        return 1;
+#ifdef DISK_MMAP
+    void* base = mmap(NULL, disk_bytes(disk_block_num), PROT_READ | PROT_WRITE, MAP_SHARED, disk_fd, 0);
+    if (base == MAP_FAILED)
+        return 1;
+    disk_base = base;
+#endif
+    return 0;
+}
+
+int disk_init()
+{
+    return disk_attach(O_TRUNC);
+}
+
+int disk_open()
+{
+    return disk_attach(0);
+}
+
+int disk_resize(int blocks)
+{
+    if (blocks < 1 || (disk_fd >= 0 && ftruncate(disk_fd, disk_bytes(blocks))))
+        return 1;
+#ifdef DISK_MMAP
+    if (disk_base != NULL) {
+        void* base = mremap(disk_base, disk_bytes(disk_block_num), disk_bytes(blocks), MREMAP_MAYMOVE);
+        if (base == MAP_FAILED)
+            return 1;
+        disk_base = base;
+    }
+#endif
+    disk_block_num = blocks;
+    return 0;
+}
+
+#ifdef DISK_MMAP
+
+int disk_read(int block_id, void* buffer)
+{
+    if (disk_range(block_id, 1) || disk_base == NULL)
+        return 1;
+    memcpy(buffer, disk_base + (size_t)block_id * BLOCK_SIZE, BLOCK_SIZE);
+    return 0;
+}
+
+int disk_write(int block_id, void* buffer)
+{
+    if (disk_range(block_id, 1) || disk_base == NULL)
+        return 1;
+    memcpy(disk_base + (size_t)block_id * BLOCK_SIZE, buffer, BLOCK_SIZE);
+    return 0;
+}
+
+int disk_readv(int block_id, const struct iovec* iov, int count)
+{
+    if (disk_range(block_id, count) || disk_base == NULL)
+        return 1;
+    for (int i = 0; i < count; ++i)
+        memcpy(iov[i].iov_base, disk_base + (size_t)(block_id + i) * BLOCK_SIZE, BLOCK_SIZE);
+    return 0;
+}
+
+int disk_writev(int block_id, const struct iovec* iov, int count)
+{
+    if (disk_range(block_id, count) || disk_base == NULL)
+        return 1;
+    for (int i = 0; i < count; ++i)
+        memcpy(disk_base + (size_t)(block_id + i) * BLOCK_SIZE, iov[i].iov_base, BLOCK_SIZE);
+    return 0;
+}
+
+void* disk_map()
+{
+    return disk_base;
+}
+
+int disk_sync()
+{
+    if (disk_base == NULL)
+        return 1;
+    return msync(disk_base, disk_bytes(disk_block_num), MS_SYNC) != 0;
+}
+
+#else
+
+int disk_read(int block_id, void* buffer)
+{
+    if (disk_range(block_id, 1))
+        return 1;
+    if (pread(disk_fd, buffer, BLOCK_SIZE, (off_t)block_id * BLOCK_SIZE) != BLOCK_SIZE)
+        return 1;
+    return 0;
+}
+
+int disk_write(int block_id, void* buffer)
+{
+    if (disk_range(block_id, 1))
+        return 1;
+    if (pwrite(disk_fd, buffer, BLOCK_SIZE, (off_t)block_id * BLOCK_SIZE) != BLOCK_SIZE)
+        return 1;
+    return 0;
+}
+
+// One preadv/pwritev per IOV_MAX blocks; the image is preallocated, so a short
+// transfer is an error
+int disk_readv(int block_id, const struct iovec* iov, int count)
+{
+    if (disk_range(block_id, count))
+        return 1;
+    for (int done = 0; done < count; done += IOV_MAX) {
+        int n = count - done < IOV_MAX ? count - done : IOV_MAX;
+        if (preadv(disk_fd, iov + done, n, (off_t)(block_id + done) * BLOCK_SIZE) != (ssize_t)n * BLOCK_SIZE)
+            return 1;
+    }
+    return 0;
+}
+
+int disk_writev(int block_id, const struct iovec* iov, int count)
+{
+    if (disk_range(block_id, count))
+        return 1;
+    for (int done = 0; done < count; done += IOV_MAX) {
+        int n = count - done < IOV_MAX ? count - done : IOV_MAX;
+        if (pwritev(disk_fd, iov + done, n, (off_t)(block_id + done) * BLOCK_SIZE) != (ssize_t)n * BLOCK_SIZE)
+            return 1;
+    }
+    return 0;
+}
+
+void* disk_map()
+{
+    return NULL;
+}
+
+int disk_sync()
+{
+    return fdatasync(disk_fd) != 0;
+}
+
+#endif
+
+#else
+
+int disk_init()
+{
+    if (disk_locate("vdisk/block"))
+        return 1;
     char name[256];
     char buffer[BLOCK_SIZE];
     memset(buffer, 0, sizeof(buffer));
-    for (int i = 0; i < BLOCK_NUM; ++i) {
+    for (int i = 0; i < disk_block_num; ++i) {
         strcpy(name, disk_prefix);
         sprintf(name + strlen(name), "%d", i);
         FILE* disk = fopen(name, "w");
         if (disk == NULL)
             return 1;
-        fwrite(&buffer, BLOCK_SIZE, 1, disk);
-        fclose(disk);
+        int ok = fwrite(&buffer, BLOCK_SIZE, 1, disk) == 1;
+        if (fclose(disk) || !ok)
+            return 1;
     }
     return 0;
 }
 
+/*
+Block files are only created by their first disk_write, a missing block
+reads as zeros. The block count disk_resize last gave the disk is kept in
+vdisk/size, a disk without one has the default size.
+*/
+static void disk_size_file(char* name)
+{
+    strcpy(name, disk_prefix);
+    strcpy(name + strlen(name) - 5, "size");
+}
+
+int disk_open()
+{
+    if (disk_locate("vdisk/block"))
+        return 1;
+    char name[256];
+    disk_size_file(name);
+    FILE* fp = fopen(name, "r");
+    if (fp == NULL)
+        return 0;
+    int blocks;
+    int ok = fscanf(fp, "%d", &blocks) == 1 && blocks > 0;
+    fclose(fp);
+    if (!ok)
+        return 1;
+    disk_block_num = blocks;
+    return 0;
+}
+
+int disk_resize(int blocks)
+{
+    if (blocks < 1)
+        return 1;
+    char name[256];
+    disk_size_file(name);
+    FILE* fp = fopen(name, "w");
+    if (fp == NULL)
+        return 1;
+    int ok = fprintf(fp, "%d\n", blocks) > 0;
+    if (fclose(fp) || !ok)
+        return 1;
+    disk_block_num = blocks;
+    return 0;
+}
+
 int disk_read(int block_id, void* buffer)
 {
-    if (block_id >= BLOCK_NUM || block_id < 0)
+    if (disk_range(block_id, 1))
         return 1;
     char name[256];
     strcpy(name, disk_prefix);
     sprintf(name + strlen(name), "%d", block_id);
+    memset(buffer, 0, BLOCK_SIZE);
     FILE* disk = fopen(name, "r");
+    if (disk == NULL)
+        return 0;
     fread(buffer, BLOCK_SIZE, 1, disk);
+    int err = ferror(disk);
     fclose(disk);
-    return 0;
+    return err != 0;
 }
 
 int disk_write(int block_id, void* buffer)
 {
-    if (block_id >= BLOCK_NUM || block_id < 0)
+    if (disk_range(block_id, 1))
         return 1;
     char name[256];
     strcpy(name, disk_prefix);
     sprintf(name + strlen(name), "%d", block_id);
-    FILE* disk = fopen(name, "w");
-    fwrite(buffer, BLOCK_SIZE, 1, disk);
-    fclose(disk);
+    // Overwritten in place, not truncated first: a crash in between would
+    // leave a block that was there before empty
+    int fd = open(name, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0)
+        return 1;
+    int ok = pwrite(fd, buffer, BLOCK_SIZE, 0) == BLOCK_SIZE;
+    return close(fd) || !ok;
+}
+
+// Every block is its own file, so a range is just a loop
+int disk_readv(int block_id, const struct iovec* iov, int count)
+{
+    if (disk_range(block_id, count))
+        return 1;
+    for (int i = 0; i < count; ++i)
+        if (disk_read(block_id + i, iov[i].iov_base))
+            return 1;
+    return 0;
+}
+
+int disk_writev(int block_id, const struct iovec* iov, int count)
+{
+    if (disk_range(block_id, count))
+        return 1;
+    for (int i = 0; i < count; ++i)
+        if (disk_write(block_id + i, iov[i].iov_base))
+            return 1;
     return 0;
-}
\ No newline at end of file
+}
+
+void* disk_map()
+{
+    return NULL;
+}
+
+// Every block file written since the last sync, and the ones created, lives
+// in vdisk, so syncing its filesystem covers them all
+int disk_sync()
+{
+    char name[256];
+    strcpy(name, disk_prefix);
+    name[strlen(name) - 5] = '\0';
+    int fd = open(name, O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return 1;
+    int err = syncfs(fd);
+    return close(fd) || err;
+}
+
+#endif
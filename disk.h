@@ -2,10 +2,23 @@
 Filesystem Lab disigned and implemented by Liang Junkai,RUC
 */
 
+#ifndef BLOCK_SIZE
 #define BLOCK_SIZE 4096
-#define BLOCK_NUM 65536
-#define DISK_SIZE (BLOCK_SIZE * BLOCK_NUM)
+#endif
+#define BLOCK_NUM 65536 // size of a fresh disk, in blocks
 
-int disk_init();
+#include <sys/uio.h>
+
+int disk_init(); // create a fresh, zeroed disk
+int disk_open(); // attach to the existing disk, missing blocks are created lazily and read as zeros
 int disk_read(int block_id, void *buffer);
 int disk_write(int block_id, void *buffer);
+// count consecutive blocks from block_id, iov[i] (of BLOCK_SIZE bytes) holding block_id + i
+int disk_readv(int block_id, const struct iovec *iov, int count);
+int disk_writev(int block_id, const struct iovec *iov, int count);
+void *disk_map(); // base address of the whole disk when it is memory mapped, NULL otherwise
+int disk_sync();  // make every completed disk_write durable
+int disk_blocks(); // size of the attached disk, in blocks
+// grow or shrink the attached disk to blocks, keeping what the blocks below both sizes
+// hold; disk_map may move. Only formatting resizes, mounting takes the disk as it is
+int disk_resize(int blocks);
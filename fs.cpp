@@ -15,6 +15,7 @@ extern "C"
 #include <cstddef>
 #include <errno.h>
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -35,22 +36,36 @@ extern "C"
 //Format the virtual block device in the following function
 int mkfs()
 {
-    Disk::mkfs();
-    return 0;
+    return Disk::mkfs(options.blocks);
+}
+
+// /.fsstats is no inode on the disk: a read-only file, not listed, whose
+// contents are a Stats snapshot taken when it is opened
+constexpr int STATS_INODE = -2;
+constexpr char STATS_NAME[] = ".fsstats";
+
+// Only inodes on the disk keep lookup and open counts, /.fsstats has none
+bool counted(int inodeno)
+{
+    return inodeno >= 0;
 }
 
+// The caller holds the directory's lock, so the dentry inserted on a miss
+// cannot race with a change to the directory
 int get_file_in_inode(int inodeno, std::string filename)
 {
-    auto directory = DirectoryProxy(inodeno);
-    int length = directory.length();
+    if (inodeno == 0 && filename == STATS_NAME)
+        return STATS_INODE;
+    int ret = -1;
+    if (DentryCache::lookup(inodeno, filename.c_str(), ret))
+        return ret;
 
-    for (int i = 0; i < length; i++)
-    {
-        auto file = directory.get(i);
-        if (file.filename == filename)
-            return file.file_inode;
-    }
-    return -1;
+    auto directory = DirectoryProxy(inodeno);
+    int index = directory.find(filename.c_str());
+    if (index != -1)
+        ret = directory.get(index).file_inode;
+    DentryCache::insert(inodeno, filename.c_str(), ret);
+    return ret;
 }
 
 std::vector<std::string, malloc_allocator<std::string>> split_path(std::string str)
@@ -72,87 +87,184 @@ std::vector<std::string, malloc_allocator<std::string>> split_path(std::string s
 int get_inode_from_path(std::string path)
 {
     int now_inode = 0; // root
+    if (DentryCache::lookup_path(path.c_str(), now_inode))
+        return now_inode;
+
+    auto generation = DentryCache::current_generation();
     auto filenames = split_path(path);
 
     for (auto &&filename : filenames)
     {
+        if (now_inode == STATS_INODE)
+            return -1;
+        ReadLock _(INodeLocks::of(now_inode));
         now_inode = get_file_in_inode(now_inode, filename);
         if (now_inode == -1)
             return -1;
     }
+    DentryCache::insert_path(path.c_str(), now_inode, generation);
     return now_inode;
 }
 
 //Filesystem operations that you need to implement
-int fs_getattr(const char *path, struct stat *attr)
+void fill_attr(int now_inode, const INodeBlock::INode &inode, struct stat *attr)
 {
-    Info << path;
-    int now_inode = get_inode_from_path(path);
-    if (now_inode == -1)
-        return -ENOENT;
-
-    auto inode = INodeProxy(now_inode).drop(); // readonly
-    attr->st_mode = inode->type == INodeBlock::INodeType::DIRECTORY ? DIRMODE : REGMODE;
+    attr->st_mode = inode.type == INodeBlock::INodeType::DIRECTORY ? DIRMODE : REGMODE;
     attr->st_nlink = 1;
     attr->st_uid = getuid();
     attr->st_gid = getgid();
-    attr->st_size = inode->filesize;
-    attr->st_atime = inode->atime;
-    attr->st_mtime = inode->mtime;
-    attr->st_ctime = inode->ctime;
+    size_t size;
+    attr->st_size = WriteBuffer::size(now_inode, size) ? size : inode.filesize;
+    attr->st_atime = inode.atime;
+    attr->st_mtime = inode.mtime;
+    attr->st_ctime = inode.ctime;
+}
 
+int getattr_inode(int now_inode, struct stat *attr)
+{
+    if (now_inode == STATS_INODE)
+    {
+        attr->st_mode = S_IFREG | 0444;
+        attr->st_nlink = 1;
+        attr->st_uid = getuid();
+        attr->st_gid = getgid();
+        attr->st_atime = attr->st_mtime = attr->st_ctime = time(NULL);
+        return 0; // size 0, reads are direct_io
+    }
+    auto inode = INodeProxy(now_inode).drop(); // readonly
+    fill_attr(now_inode, *inode, attr);
     return 0;
 }
 
-int fs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+int fs_getattr(const char *path, struct stat *attr)
 {
     Info << path;
-    auto now_inode = fi->fh;
+    Stats::Scope stats(Stats::GETATTR);
+    int now_inode = get_inode_from_path(path);
+    if (now_inode == -1)
+        return -ENOENT;
+    return getattr_inode(now_inode, attr);
+}
 
-    DirectoryProxy directory(now_inode);
-    int size = directory.length();
+// The handle based calls below skip the path walk
+int fs_fgetattr(const char *path, struct stat *attr, struct fuse_file_info *fi)
+{
+    Info << path;
+    Stats::Scope stats(Stats::FGETATTR);
+    return getattr_inode(OpenFile::from(fi)->inodeno, attr);
+}
 
-    for (int i = 0; i < size; i++)
+// Hands add(name, attributes, offset of the next entry) the entries of an
+// open directory from offset on, until it returns false. The listing is
+// taken at offset 0 and kept in the handle, so a reader at any later offset
+// sees the same entries whatever changed since; their inodes are fetched a
+// batch at a time.
+template <typename Add>
+int list_directory(OpenFile *dir, off_t offset, Add &&add)
+{
+    static constexpr int BATCH = 64;
+    if (dir->inodeno == STATS_INODE)
+        return -ENOTDIR;
+    MutexLock _(dir->lock);
+    auto &&listing = dir->listing;
+    if (offset == 0)
     {
-        auto file = directory.get(i);
-        Debug << Show(file.filename);
-        filler(buffer, file.filename, NULL, 0);
+        ReadLock _(INodeLocks::of(dir->inodeno));
+        listing.clear();
+        for (auto &&item : DirectoryProxy(dir->inodeno))
+        {
+            Debug << Show(item.filename);
+            auto bytes = reinterpret_cast<const char *>(&item);
+            listing.insert(listing.end(), bytes, bytes + item.size());
+        }
+        auto inode = INodeProxy(dir->inodeno);
+        if (inode.access())
+            inode.commit();
+        else
+            inode.drop();
     }
 
+    for (size_t now = offset; now < listing.size();)
+    {
+        const DirectoryProxy::Item *items[BATCH];
+        int inodenos[BATCH], count = 0;
+        size_t next[BATCH];
+        for (size_t position = now; position < listing.size() && count < BATCH; count++)
+        {
+            items[count] = reinterpret_cast<const DirectoryProxy::Item *>(listing.data() + position);
+            inodenos[count] = items[count]->file_inode;
+            next[count] = position += items[count]->size();
+        }
+        INodeBlock::INode inodes[BATCH];
+        if (INodeCache::get_many(inodenos, count, inodes))
+            return -EIO;
+        for (int i = 0; i < count; i++)
+        {
+            struct stat attr = {};
+            fill_attr(inodenos[i], inodes[i], &attr);
+            attr.st_ino = inodenos[i] + FUSE_ROOT_ID;
+            if (!add(items[i]->filename, &attr, next[i]))
+                return 0;
+        }
+        now = next[count - 1];
+    }
     return 0;
 }
 
+int fs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+{
+    Info << path << Show(offset);
+    Stats::Scope stats(Stats::READDIR);
+    return list_directory(OpenFile::from(fi), offset, [&](const char *name, const struct stat *attr, off_t next) {
+        return filler(buffer, name, attr, next) == 0;
+    });
+}
+
 int fs_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi)
 {
     Debug << path << Show(size) << Show(offset);
-    auto file_inode = fi->fh;
-    DataProxy data(file_inode);
-    return data.read(offset, size, buffer);
+    Stats::Scope stats(Stats::READ);
+    auto file = OpenFile::from(fi);
+    if (file->inodeno == STATS_INODE)
+    {
+        auto &&text = file->listing;
+        size_t ret = offset < text.size() ? std::min(size, text.size() - offset) : 0;
+        memcpy(buffer, text.data() + offset, ret);
+        return ret;
+    }
+    ReadLock _(INodeLocks::of(file->inodeno));
+    DataProxy data(file->inodeno);
+    size_t ret;
+    if (!WriteBuffer::read(file->inodeno, offset, size, buffer, ret))
+        ret = data.read(offset, size, buffer);
+    int first, count;
+    if (file->advance(offset, ret, first, count))
+        data.readahead(first, count);
+    return ret;
 }
 
-int make_node(const char *path, INodeBlock::INodeType mode)
+// The node named filename in dirnode, created unless it exists. With lookup
+// the node gets a kernel lookup counted while the name still leads to it
+int make_node_in(int dirnode, const std::string &filename, INodeBlock::INodeType mode, int &filenode,
+                 bool lookup = false)
 {
-    Info << path << Show((int)mode);
-    std::string strpath = path;
-    std::string dirname = strpath.substr(0, strpath.find_last_of('/'));
-    std::string filename = strpath.substr(strpath.find_last_of('/') + 1);
-
-    int dirnode = get_inode_from_path(dirname);
-
-    if (dirnode == -1)
-        return -ENOENT;
-    int filenode = get_file_in_inode(dirnode, filename);
+    if (dirnode == STATS_INODE)
+        return -ENOTDIR;
+    Transaction transaction;
+    WriteLock _(INodeLocks::of(dirnode));
+    filenode = get_file_in_inode(dirnode, filename);
+    if (filenode == STATS_INODE)
+        return -EEXIST;
     DirectoryProxy directory(dirnode);
     if (filenode == -1)
     {
         // Create new
-        if (filename.length() > 24)
-            return -ENOSPC;
-        DirectoryProxy::Item item;
-        strcpy(item.filename, filename.c_str());
-        item.file_inode = filenode = Disk::alloc_inode();
-        if (item.file_inode == -1)
+        if (filename.length() > DirectoryProxy::NAME_LENGTH)
+            return -ENAMETOOLONG;
+        filenode = Disk::alloc_inode(dirnode, mode == INodeBlock::INodeType::DIRECTORY);
+        if (filenode == -1)
             return -ENOSPC;
+        DirectoryProxy::Item item(filenode, filename.c_str());
         {
             INodeProxy inode(item.file_inode);
             memset(&*inode, 0, sizeof(decltype(*inode)));
@@ -165,14 +277,18 @@ int make_node(const char *path, INodeBlock::INodeType mode)
             Disk::free_inode(item.file_inode);
             return -err;
         }
+        DentryCache::insert(dirnode, item.filename, item.file_inode);
     }
+    if (lookup && counted(filenode))
+        INodeRefs::lookup(filenode);
 
     return 0;
 }
 
-int delete_node(const char *path)
+int make_node(const char *path, INodeBlock::INodeType mode)
 {
-    Info << path;
+    Info << path << Show((int)mode);
+    Stats::Scope stats(mode == INodeBlock::INodeType::DIRECTORY ? Stats::MKDIR : Stats::MKNOD);
     std::string strpath = path;
     std::string dirname = strpath.substr(0, strpath.find_last_of('/'));
     std::string filename = strpath.substr(strpath.find_last_of('/') + 1);
@@ -181,30 +297,86 @@ int delete_node(const char *path)
 
     if (dirnode == -1)
         return -ENOENT;
-    int filenode = get_file_in_inode(dirnode, filename);
-    DirectoryProxy directory(dirnode);
-    if (filenode == -1)
-        return -ENOENT;
+    int filenode;
+    return make_node_in(dirnode, filename, mode, filenode);
+}
 
-    // Create new
+// Frees a node nothing names or refers to any more, inside the caller's
+// Transaction
+void free_node(int filenode)
+{
+    WriteLock _(INodeLocks::of(filenode));
+    WriteBuffer::discard(filenode);
     DataProxy proxy(filenode);
     proxy.resize(0); // Delete all data
+    DirectoryProxy(filenode).remove_index();
+    DentryCache::forget(filenode);
+    Disk::remove_orphan(filenode);
+    Disk::free_inode(filenode);
+}
 
-    for (int i = 0, end = directory.length(); i < end; i++)
+// Frees what the orphan list still holds, the nodes a crash caught unlinked
+// but open; nothing refers to them after a mount
+void free_orphans()
+{
+    for (int inodeno; (inodeno = Disk::last_orphan()) != -1;)
     {
-        if (directory.get(i).filename == filename)
-        {
-            directory.erase(i);
-            Disk::free_inode(filenode);
-            return 0;
-        }
+        Info << "Freeing orphan" << Show(inodeno);
+        Transaction transaction;
+        free_node(inodeno);
+    }
+}
+
+// Unlinks the node named filename in dirnode; the node itself goes once the
+// last open handle and kernel lookup of it are gone
+int delete_node_in(int dirnode, const std::string &filename)
+{
+    if (dirnode == STATS_INODE)
+        return -ENOTDIR;
+    if (dirnode == 0 && filename == STATS_NAME)
+        return -EACCES;
+    Transaction transaction;
+    // Unlink under the parent's lock, then free under the node's own, so no
+    // two inode locks are ever held here
+    int filenode;
+    {
+        WriteLock _(INodeLocks::of(dirnode));
+        filenode = get_file_in_inode(dirnode, filename);
+        DirectoryProxy directory(dirnode);
+        if (filenode == -1)
+            return -ENOENT;
+
+        int index = directory.find(filename.c_str());
+        // This shouldn't fail
+        assert(index != -1);
+
+        directory.erase(index);
+        DentryCache::insert(dirnode, filename.c_str(), -1);
+        DentryCache::invalidate_paths();
+        // In the same transaction as the erase, before anyone can free it
+        Disk::add_orphan(filenode);
     }
-    // This shouldn't be reached
-    assert(false);
 
+    if (INodeRefs::unlink(filenode))
+        free_node(filenode);
     return 0;
 }
 
+int delete_node(const char *path, Stats::Op op)
+{
+    Info << path;
+    Stats::Scope stats(op);
+    std::string strpath = path;
+    std::string dirname = strpath.substr(0, strpath.find_last_of('/'));
+    std::string filename = strpath.substr(strpath.find_last_of('/') + 1);
+
+    int dirnode = get_inode_from_path(dirname);
+
+    if (dirnode == -1)
+        return -ENOENT;
+    return delete_node_in(dirnode, filename);
+}
+
 int fs_mknod(const char *path, mode_t mode, dev_t dev)
 {
     return make_node(path, INodeBlock::INodeType::FILE);
@@ -217,211 +389,757 @@ int fs_mkdir(const char *path, mode_t mode)
 
 int fs_rmdir(const char *path)
 {
-    return delete_node(path);
+    return delete_node(path, Stats::RMDIR);
 }
 
 int fs_unlink(const char *path)
 {
-    return delete_node(path);
+    return delete_node(path, Stats::UNLINK);
 }
 
-int fs_rename(const char *oldpath, const char *newname)
+int rename_node(int olddirnode, const std::string &oldfilename, int newdirnode, const std::string &newfilename)
 {
-    Info << Show(oldpath) << Show(newname);
-    std::string str_oldpath = oldpath;
-    std::string olddirname = str_oldpath.substr(0, str_oldpath.find_last_of('/'));
-    std::string oldfilename = str_oldpath.substr(str_oldpath.find_last_of('/') + 1);
-
-    std::string str_newpath = newname;
-    std::string newdirname = str_newpath.substr(0, str_newpath.find_last_of('/'));
-    std::string newfilename = str_newpath.substr(str_newpath.find_last_of('/') + 1);
+    if (newfilename.length() > DirectoryProxy::NAME_LENGTH)
+        return -ENAMETOOLONG;
+    if (olddirnode == STATS_INODE || newdirnode == STATS_INODE)
+        return -ENOTDIR;
+    if (olddirnode == 0 && oldfilename == STATS_NAME)
+        return -EACCES;
+    Transaction transaction;
+    // Both parents, the lower inode first
+    WriteLock _(INodeLocks::of(std::min(olddirnode, newdirnode)));
+    if (olddirnode != newdirnode)
+        pthread_rwlock_wrlock(&INodeLocks::of(std::max(olddirnode, newdirnode)));
+    Defer unlock([&]() {
+        if (olddirnode != newdirnode)
+            pthread_rwlock_unlock(&INodeLocks::of(std::max(olddirnode, newdirnode)));
+    });
 
-    if (newfilename.length() > 24)
-        return -ENOSPC;
-    if (get_inode_from_path(oldpath) == -1)
+    int filenode = get_file_in_inode(olddirnode, oldfilename);
+    if (filenode == -1)
         return -ENOENT;
-    if (get_inode_from_path(newname) != -1)
+    if (get_file_in_inode(newdirnode, newfilename) != -1)
         return -EACCES;
 
-    if (olddirname == newdirname)
+    if (olddirnode == newdirnode)
     {
-        int dirnode = get_inode_from_path(olddirname);
-        if (dirnode == -1)
-            return -ENOENT;
-        DirectoryProxy directory(dirnode);
+        DirectoryProxy directory(olddirnode);
 
-        for (int i = 0, end = directory.length(); i < end; i++)
-        {
-            auto path = directory.get(i);
-            if (path.filename == oldfilename)
-            {
-                strcpy(path.filename, newfilename.c_str());
-                directory.set(i, path);
-                return 0;
-            }
-        }
-        // This should not be reached
-        assert(false);
+        int index = directory.find(oldfilename.c_str());
+        // This should not fail
+        assert(index != -1);
+
+        // The new name may need more room, so it goes in as a new entry
+        if (auto err = directory.push(DirectoryProxy::Item(filenode, newfilename.c_str())))
+            return -err;
+        directory.erase(index);
+        DentryCache::insert(olddirnode, oldfilename.c_str(), -1);
+        DentryCache::insert(olddirnode, newfilename.c_str(), filenode);
+        DentryCache::invalidate_paths();
+        return 0;
     }
     else
     {
-        int olddirnode = get_inode_from_path(olddirname);
-        int newdirnode = get_inode_from_path(newdirname);
-        if (olddirnode == -1 || newdirnode == -1)
-            return -ENOENT;
         DirectoryProxy old_(olddirnode), new_(newdirnode);
 
-        for (int i = 0, end = old_.length(); i < end; i++)
-        {
-            auto path = old_.get(i);
-            if (path.filename == oldfilename)
-            {
-                strcpy(path.filename, newfilename.c_str());
-                if (auto err = new_.push(path))
-                    return -err;
-                old_.erase(i);
-                return 0;
-            }
-        }
-        // This should not be reached
-        assert(false);
+        int index = old_.find(oldfilename.c_str());
+        // This should not fail
+        assert(index != -1);
+
+        if (auto err = new_.push(DirectoryProxy::Item(filenode, newfilename.c_str())))
+            return -err;
+        old_.erase(index);
+        DentryCache::insert(olddirnode, oldfilename.c_str(), -1);
+        DentryCache::insert(newdirnode, newfilename.c_str(), filenode);
+        DentryCache::invalidate_paths();
+        return 0;
     }
-    return 0;
+}
+
+int fs_rename(const char *oldpath, const char *newname)
+{
+    Info << Show(oldpath) << Show(newname);
+    Stats::Scope stats(Stats::RENAME);
+    std::string str_oldpath = oldpath;
+    std::string olddirname = str_oldpath.substr(0, str_oldpath.find_last_of('/'));
+    std::string oldfilename = str_oldpath.substr(str_oldpath.find_last_of('/') + 1);
+
+    std::string str_newpath = newname;
+    std::string newdirname = str_newpath.substr(0, str_newpath.find_last_of('/'));
+    std::string newfilename = str_newpath.substr(str_newpath.find_last_of('/') + 1);
+
+    int olddirnode = get_inode_from_path(olddirname);
+    int newdirnode = get_inode_from_path(newdirname);
+    if (olddirnode == -1 || newdirnode == -1)
+        return -ENOENT;
+    return rename_node(olddirnode, oldfilename, newdirnode, newfilename);
 }
 
 int fs_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi)
 {
     Debug << path << Show(size) << Show(offset);
-    auto file_inode = fi->fh;
+    Stats::Scope stats(Stats::WRITE);
+    Transaction transaction;
+    auto file_inode = OpenFile::from(fi)->inodeno;
+    WriteLock _(INodeLocks::of(file_inode));
+    if (WriteBuffer::write(file_inode, offset, size, buffer))
+        return size;
+    if (auto err = WriteBuffer::flush(file_inode))
+        return -err;
     auto inode = INodeProxy(file_inode).drop();
     DataProxy data(file_inode);
     if (size + offset > inode->filesize)
-        if (auto err = data.resize(size + offset))
+        if (auto err = data.resize(size + offset, size))
             return -err;
     return data.write(offset, size, buffer);
 }
 
+int truncate_inode(int now_inode, off_t size)
+{
+    if (now_inode == STATS_INODE)
+        return -EACCES;
+    Transaction transaction;
+    WriteLock _(INodeLocks::of(now_inode));
+    if (auto err = WriteBuffer::flush(now_inode))
+        return -err;
+    return -DataProxy(now_inode).resize(size);
+}
+
 int fs_truncate(const char *path, off_t size)
 {
     Info << path << Show(size);
+    Stats::Scope stats(Stats::TRUNCATE);
     auto now_inode = get_inode_from_path(path);
 
     if (now_inode == -1)
         return -ENOENT;
+    return truncate_inode(now_inode, size);
+}
 
-    return -DataProxy(now_inode).resize(size);
+int fs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    Info << path << Show(size);
+    Stats::Scope stats(Stats::FTRUNCATE);
+    return truncate_inode(OpenFile::from(fi)->inodeno, size);
+}
+
+int utime_inode(int inodenum, time_t actime, time_t modtime)
+{
+    if (inodenum == STATS_INODE)
+        return -EACCES;
+    Transaction transaction;
+    WriteLock _(INodeLocks::of(inodenum));
+    auto inode = INodeProxy(inodenum);
+    inode->mtime = modtime;
+    inode->atime = actime;
+    inode->ctime = time(NULL);
+    inode.commit();
+
+    return 0;
 }
 
 int fs_utime(const char *path, struct utimbuf *buffer)
 {
     Info;
+    Stats::Scope stats(Stats::UTIME);
     auto inodenum = get_inode_from_path(path);
     if (inodenum == -1)
         return -ENOENT;
-    auto inode = INodeProxy(inodenum);
-    inode->mtime = buffer->modtime;
-    inode->atime = buffer->actime;
-    inode->ctime = time(NULL);
-    inode.commit();
+    return utime_inode(inodenum, buffer->actime, buffer->modtime);
+}
 
-    return 0;
+// Every node has the fixed mode and owner getattr_inode reports, so chmod
+// and chown succeed without changing anything, through either frontend
+int fs_chmod(const char *path, mode_t mode)
+{
+    Info << path << Show(mode);
+    Stats::Scope stats(Stats::SETATTR);
+    return get_inode_from_path(path) == -1 ? -ENOENT : 0;
+}
+
+int fs_chown(const char *path, uid_t uid, gid_t gid)
+{
+    Info << path << Show(uid) << Show(gid);
+    Stats::Scope stats(Stats::SETATTR);
+    return get_inode_from_path(path) == -1 ? -ENOENT : 0;
 }
 
 int fs_statfs(const char *path, struct statvfs *stat)
 {
     Info;
-    auto header = Disk::get_header().drop(); // read only
+    Stats::Scope stats(Stats::STATFS);
+    auto header = Disk::usage();
     stat->f_bsize = BLOCK_SIZE;
-    stat->f_blocks = header->data_block_num_tot;
-    stat->f_bfree = stat->f_bavail = header->data_block_num_free;
-    stat->f_files = header->inode_num_tot;
-    stat->f_ffree = stat->f_favail = header->inode_num_free;
+    stat->f_blocks = header.data_block_num_tot;
+    stat->f_bfree = stat->f_bavail = header.data_block_num_free;
+    stat->f_files = header.inode_num_tot;
+    stat->f_ffree = stat->f_favail = header.inode_num_free;
     return 0;
 }
 
-int fs_open(const char *path, struct fuse_file_info *fi)
+// Files and directories alike get an OpenFile in fi->fh, with their inode
+// pinned in the cache until it is released
+int open_inode(int now_inode, struct fuse_file_info *fi)
 {
-    Info << path;
+    if (now_inode == STATS_INODE && (fi->flags & O_ACCMODE) != O_RDONLY)
+        return -EACCES;
+    auto file = static_cast<OpenFile *>(malloc(sizeof(OpenFile)));
+    if (file == nullptr)
+        return -ENOMEM;
+    fi->fh = reinterpret_cast<uint64_t>(new (file) OpenFile(now_inode));
+    if (now_inode == STATS_INODE)
+    {
+        Stats::snapshot(file->listing);
+        fi->direct_io = 1; // its size is 0, the reads have to come anyway
+        return 0;
+    }
+    INodeRefs::open(now_inode);
+    INodeCache::pin(now_inode);
+    return 0;
+}
 
-    int now_inode = 0; // root
-    auto filenames = split_path(path);
+int open_handle(const char *path, struct fuse_file_info *fi)
+{
+    int now_inode = get_inode_from_path(path);
+    if (now_inode == -1)
+        return -ENOENT;
+    return open_inode(now_inode, fi);
+}
 
-    for (auto &&filename : filenames)
+void release_handle(OpenFile *file)
+{
+    int inodeno = file->inodeno;
+    file->~OpenFile();
+    free(file);
+    if (inodeno == STATS_INODE)
+        return;
+    INodeCache::unpin(inodeno);
+    if (INodeRefs::release(inodeno))
     {
-        now_inode = get_file_in_inode(now_inode, filename);
-        if (now_inode == -1)
-            return -ENOENT;
+        Transaction transaction;
+        free_node(inodeno);
     }
+}
 
-    fi->fh = now_inode;
-    return 0;
+int fs_open(const char *path, struct fuse_file_info *fi)
+{
+    Info << path;
+    Stats::Scope stats(Stats::OPEN);
+    return open_handle(path, fi);
+}
+
+// Called on every close(); the delayed blocks get allocated here so ENOSPC
+// still reaches the application
+int fs_flush(const char *path, struct fuse_file_info *fi)
+{
+    Info << path;
+    Stats::Scope stats(Stats::FLUSH);
+    auto file_inode = OpenFile::from(fi)->inodeno;
+    if (file_inode == STATS_INODE)
+        return 0;
+    Transaction transaction;
+    WriteLock _(INodeLocks::of(file_inode));
+    return -WriteBuffer::flush(file_inode);
 }
 
 //Functions you don't actually need to modify
 int fs_release(const char *path, struct fuse_file_info *fi)
 {
     Info;
+    Stats::Scope stats(Stats::RELEASE);
+    auto file = OpenFile::from(fi);
+    // The buffer of an unlinked file is not worth blocks, it is discarded
+    // along with the file or stays for the handles still open
+    if (file->inodeno != STATS_INODE && !INodeRefs::unlinked(file->inodeno))
+    {
+        Transaction transaction;
+        WriteLock _(INodeLocks::of(file->inodeno));
+        WriteBuffer::flush(file->inodeno);
+    }
+    release_handle(file);
     return 0;
 }
 
 int fs_opendir(const char *path, struct fuse_file_info *fi)
 {
     Info << path;
-
-    int now_inode = 0; // root
-    auto filenames = split_path(path);
-
-    for (auto &&filename : filenames)
-    {
-        now_inode = get_file_in_inode(now_inode, filename);
-        if (now_inode == -1)
-            return -ENOENT;
-    }
-
-    fi->fh = now_inode;
-    return 0;
+    Stats::Scope stats(Stats::OPENDIR);
+    return open_handle(path, fi);
 }
 
 int fs_releasedir(const char *path, struct fuse_file_info *fi)
 {
     Info;
+    Stats::Scope stats(Stats::RELEASEDIR);
+    release_handle(OpenFile::from(fi));
     return 0;
 }
 
+int fs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    Info << path;
+    Stats::Scope stats(Stats::FSYNC);
+    if (auto err = WriteBuffer::flush_all())
+        return -err;
+    return Disk::flush() ? -EIO : 0;
+}
+
+void fs_destroy(void *private_data)
+{
+    Info;
+    WriteBuffer::flush_all();
+    for (int inodeno; (inodeno = INodeRefs::take_unlinked()) != -1;)
+    {
+        Transaction transaction;
+        free_node(inodeno);
+    }
+    Disk::flush();
+}
+
+// The low-level frontend: the kernel names nodes by inode number, FUSE_ROOT_ID
+// being our inode 0, and caches entries and attributes for the timeouts below,
+// so no path is ever walked. Every entry replied counts a lookup, taken under
+// the parent's lock, and an unlinked node lives on until forget drops the last.
+namespace lowlevel
+{
+    constexpr double ENTRY_TIMEOUT = 1.0, ATTR_TIMEOUT = 1.0;
+
+    int inode_of(fuse_ino_t ino)
+    {
+        return ino - FUSE_ROOT_ID;
+    }
+
+    void forget_inode(int inodeno, uint64_t nlookup)
+    {
+        if (counted(inodeno) && INodeRefs::forget(inodeno, nlookup))
+        {
+            Transaction transaction;
+            free_node(inodeno);
+        }
+    }
+
+    // The lookup of a positive entry is already counted
+    void reply_entry(fuse_req_t req, int inodeno)
+    {
+        struct fuse_entry_param entry = {};
+        entry.entry_timeout = ENTRY_TIMEOUT;
+        if (inodeno != -1) // otherwise a negative entry, cached all the same
+        {
+            entry.ino = inodeno + FUSE_ROOT_ID;
+            entry.attr_timeout = ATTR_TIMEOUT;
+            getattr_inode(inodeno, &entry.attr);
+            entry.attr.st_ino = entry.ino;
+        }
+        if (fuse_reply_entry(req, &entry) && inodeno != -1)
+            forget_inode(inodeno, 1); // the kernel never got it, nor will it forget it
+    }
+
+    void reply_attr(fuse_req_t req, fuse_ino_t ino)
+    {
+        struct stat attr = {};
+        getattr_inode(inode_of(ino), &attr);
+        attr.st_ino = ino;
+        fuse_reply_attr(req, &attr, ATTR_TIMEOUT);
+    }
+
+    void lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+    {
+        Info << Show(parent) << name;
+        Stats::Scope stats(Stats::LOOKUP);
+        int dirnode = inode_of(parent), filenode;
+        {
+            ReadLock _(INodeLocks::of(dirnode));
+            filenode = get_file_in_inode(dirnode, name);
+            if (counted(filenode))
+                INodeRefs::lookup(filenode);
+        }
+        reply_entry(req, filenode);
+    }
+
+    void forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+    {
+        forget_inode(inode_of(ino), nlookup);
+        fuse_reply_none(req);
+    }
+
+    void getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+    {
+        Info << Show(ino);
+        Stats::Scope stats(Stats::GETATTR);
+        reply_attr(req, ino);
+    }
+
+    void setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi)
+    {
+        Info << Show(ino) << Show(to_set);
+        Stats::Scope stats(Stats::SETATTR);
+        int inodeno = inode_of(ino);
+        // Modes and owners are fixed and changes to them ignored, as fs_chmod
+        // and fs_chown do
+        if (to_set & FUSE_SET_ATTR_SIZE)
+            if (int err = truncate_inode(inodeno, attr->st_size))
+            {
+                fuse_reply_err(req, -err);
+                return;
+            }
+        int times = FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME | FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW;
+        if (to_set & times)
+        {
+            struct stat now;
+            getattr_inode(inodeno, &now);
+            time_t actime = now.st_atime, modtime = now.st_mtime;
+            if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+                actime = time(NULL);
+            else if (to_set & FUSE_SET_ATTR_ATIME)
+                actime = attr->st_atime;
+            if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+                modtime = time(NULL);
+            else if (to_set & FUSE_SET_ATTR_MTIME)
+                modtime = attr->st_mtime;
+            utime_inode(inodeno, actime, modtime);
+        }
+        reply_attr(req, ino);
+    }
+
+    void make(fuse_req_t req, fuse_ino_t parent, const char *name, INodeBlock::INodeType mode)
+    {
+        Info << Show(parent) << name << Show((int)mode);
+        Stats::Scope stats(mode == INodeBlock::INodeType::DIRECTORY ? Stats::MKDIR : Stats::MKNOD);
+        int filenode;
+        if (int err = make_node_in(inode_of(parent), name, mode, filenode, true))
+            fuse_reply_err(req, -err);
+        else
+            reply_entry(req, filenode);
+    }
+
+    void mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev)
+    {
+        make(req, parent, name, INodeBlock::INodeType::FILE);
+    }
+
+    void mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+    {
+        make(req, parent, name, INodeBlock::INodeType::DIRECTORY);
+    }
+
+    void create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi)
+    {
+        Info << Show(parent) << name;
+        Stats::Scope stats(Stats::CREATE);
+        int filenode;
+        int err = make_node_in(inode_of(parent), name, INodeBlock::INodeType::FILE, filenode, true);
+        if (err)
+        {
+            fuse_reply_err(req, -err);
+            return;
+        }
+        if ((err = open_inode(filenode, fi)))
+        {
+            forget_inode(filenode, 1);
+            fuse_reply_err(req, -err);
+            return;
+        }
+        struct fuse_entry_param entry = {};
+        entry.ino = filenode + FUSE_ROOT_ID;
+        entry.entry_timeout = ENTRY_TIMEOUT;
+        entry.attr_timeout = ATTR_TIMEOUT;
+        getattr_inode(filenode, &entry.attr);
+        entry.attr.st_ino = entry.ino;
+        if (fuse_reply_create(req, &entry, fi))
+        {
+            release_handle(OpenFile::from(fi));
+            forget_inode(filenode, 1);
+        }
+    }
+
+    void remove(fuse_req_t req, fuse_ino_t parent, const char *name, Stats::Op op)
+    {
+        Info << Show(parent) << name;
+        Stats::Scope stats(op);
+        fuse_reply_err(req, -delete_node_in(inode_of(parent), name));
+    }
+
+    void unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+    {
+        remove(req, parent, name, Stats::UNLINK);
+    }
+
+    void rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+    {
+        remove(req, parent, name, Stats::RMDIR);
+    }
+
+    void rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname)
+    {
+        Info << Show(parent) << name << Show(newparent) << newname;
+        Stats::Scope stats(Stats::RENAME);
+        fuse_reply_err(req, -rename_node(inode_of(parent), name, inode_of(newparent), newname));
+    }
+
+    void open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi, Stats::Op op)
+    {
+        Info << Show(ino);
+        Stats::Scope stats(op);
+        if (int err = open_inode(inode_of(ino), fi))
+            fuse_reply_err(req, -err);
+        else if (fuse_reply_open(req, fi))
+            release_handle(OpenFile::from(fi)); // no release follows a reply that failed
+    }
+
+    void open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+    {
+        open(req, ino, fi, Stats::OPEN);
+    }
+
+    void opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+    {
+        open(req, ino, fi, Stats::OPENDIR);
+    }
+
+    void read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+    {
+        auto buffer = static_cast<char *>(malloc(size));
+        if (buffer == nullptr)
+        {
+            fuse_reply_err(req, ENOMEM);
+            return;
+        }
+        int ret = fs_read("", buffer, size, off, fi);
+        if (ret < 0)
+            fuse_reply_err(req, -ret);
+        else
+            fuse_reply_buf(req, buffer, ret);
+        free(buffer);
+    }
+
+    void write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi)
+    {
+        int ret = fs_write("", buf, size, off, fi);
+        if (ret < 0)
+            fuse_reply_err(req, -ret);
+        else
+            fuse_reply_write(req, ret);
+    }
+
+    void flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+    {
+        fuse_reply_err(req, -fs_flush("", fi));
+    }
+
+    void release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+    {
+        fuse_reply_err(req, -fs_release("", fi));
+    }
+
+    void fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+    {
+        fuse_reply_err(req, -fs_fsync("", datasync, fi));
+    }
+
+    void readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+    {
+        Info << Show(ino) << Show(size) << Show(off);
+        Stats::Scope stats(Stats::READDIR);
+        auto buffer = static_cast<char *>(malloc(size));
+        if (buffer == nullptr)
+        {
+            fuse_reply_err(req, ENOMEM);
+            return;
+        }
+        size_t used = 0;
+        int err = list_directory(OpenFile::from(fi), off, [&](const char *name, const struct stat *attr, off_t next) {
+            size_t length = fuse_add_direntry(req, buffer + used, size - used, name, attr, next);
+            if (length > size - used)
+                return false;
+            used += length;
+            return true;
+        });
+        if (err)
+            fuse_reply_err(req, -err);
+        else
+            fuse_reply_buf(req, buffer, used);
+        free(buffer);
+    }
+
+    void releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+    {
+        Stats::Scope stats(Stats::RELEASEDIR);
+        release_handle(OpenFile::from(fi));
+        fuse_reply_err(req, 0);
+    }
+
+    void statfs(fuse_req_t req, fuse_ino_t ino)
+    {
+        struct statvfs stat = {};
+        fs_statfs("", &stat);
+        fuse_reply_statfs(req, &stat);
+    }
+
+    void destroy(void *userdata)
+    {
+        fs_destroy(userdata);
+    }
+
+    // As fuse_main does it, multithreaded unless -s
+    int main(struct fuse_args *args)
+    {
+        struct fuse_lowlevel_ops operations = {};
+        operations.lookup = lookup;
+        operations.forget = forget;
+        operations.getattr = getattr;
+        operations.setattr = setattr;
+        operations.mknod = mknod;
+        operations.mkdir = mkdir;
+        operations.create = create;
+        operations.unlink = unlink;
+        operations.rmdir = rmdir;
+        operations.rename = rename;
+        operations.open = open;
+        operations.read = read;
+        operations.write = write;
+        operations.flush = flush;
+        operations.release = release;
+        operations.fsync = fsync;
+        operations.opendir = opendir;
+        operations.readdir = readdir;
+        operations.releasedir = releasedir;
+        operations.fsyncdir = fsync;
+        operations.statfs = statfs;
+        operations.destroy = destroy;
+
+        char *mountpoint = nullptr;
+        int multithreaded, foreground, err = -1;
+        struct fuse_chan *channel;
+        if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) != -1 &&
+            (channel = fuse_mount(mountpoint, args)) != nullptr)
+        {
+            if (auto session = fuse_lowlevel_new(args, &operations, sizeof(operations), nullptr))
+            {
+                if (fuse_set_signal_handlers(session) != -1)
+                {
+                    fuse_session_add_chan(session, channel);
+                    fuse_daemonize(foreground);
+                    err = multithreaded ? fuse_session_loop_mt(session) : fuse_session_loop(session);
+                    fuse_remove_signal_handlers(session);
+                    fuse_session_remove_chan(channel);
+                }
+                fuse_session_destroy(session);
+            }
+            fuse_unmount(mountpoint, channel);
+        }
+        free(mountpoint);
+        fuse_opt_free_args(args);
+        return err ? 1 : 0;
+    }
+} // namespace lowlevel
+
+// Left out with -DNO_MAIN, for programs that call the operations directly
+#ifndef NO_MAIN
 static struct fuse_operations fs_operations = {};
 
+static struct fuse_opt fs_options[] = {
+    {"format", offsetof(Options, format), 1},
+    {"strictatime", offsetof(Options, atime), Options::STRICTATIME},
+    {"relatime", offsetof(Options, atime), Options::RELATIME},
+    {"noatime", offsetof(Options, atime), Options::NOATIME},
+    {"lowlevel", offsetof(Options, lowlevel), 1},
+    {"blocks=%d", offsetof(Options, blocks), 0},
+    FUSE_OPT_END};
+
+// What keeps the disk from mounting, for a Disk::mount error
+static const char *mount_error(int err)
+{
+    switch (err)
+    {
+    case EPROTO:
+        return "it was formatted by another version of this filesystem";
+    case EMEDIUMTYPE:
+        return "it was formatted with another block size";
+    case ENOSPC:
+        return "the disk is smaller than the filesystem on it";
+    case EINVAL:
+        return "its superblock or journal is corrupt";
+    case EIO:
+        return "reading it or replaying its journal failed";
+    default:
+        return strerror(err);
+    }
+}
+
 int main(int argc, char *argv[])
 {
-    if (disk_init())
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, &options, fs_options, NULL) == -1)
+        return -1;
+
+    if (disk_open())
     {
         printf("Can't open virtual disk!\n");
         return -1;
     }
-    if (mkfs())
+    // Only a disk without a filesystem gets one unasked; anything else that
+    // keeps it from mounting is left alone for the user to look at
+    if (int err = options.format ? ENODEV : Disk::mount())
     {
-        printf("Mkfs failed!\n");
-        return -2;
+        if (err != ENODEV)
+        {
+            printf("Can't mount the virtual disk: %s\n", mount_error(err));
+            // A disk that failed may still hold a journal to replay, formatting would lose it
+            if (err == EIO || err == ENOMEM)
+                printf("Nothing was changed, mount again once the disk can be read\n");
+            else if (err == EMEDIUMTYPE)
+                printf("Build with \"make BLOCK_SIZE=%u\" to mount it, this build uses %d\n",
+                       Disk::formatted.block_size, BLOCK_SIZE);
+            else if (err == ENOSPC)
+                printf("The filesystem has %u blocks, the disk only %d; restore the rest of the disk to mount it\n",
+                       Disk::formatted.block_num, Disk::blocks());
+            else
+                printf("Run with -o format to discard it and make a new filesystem\n");
+            return -1;
+        }
+        Info << "Formatting";
+        if (mkfs())
+        {
+            printf("Mkfs failed!\n");
+            return -2;
+        }
     }
+    free_orphans();
+
+    if (options.lowlevel)
+        return lowlevel::main(&args);
 
     fs_operations.getattr = fs_getattr,
+    fs_operations.fgetattr = fs_fgetattr,
     fs_operations.mknod = fs_mknod,
     fs_operations.mkdir = fs_mkdir,
     fs_operations.unlink = fs_unlink,
     fs_operations.rmdir = fs_rmdir,
     fs_operations.rename = fs_rename,
     fs_operations.truncate = fs_truncate,
+    fs_operations.ftruncate = fs_ftruncate,
     fs_operations.utime = fs_utime,
+    fs_operations.chmod = fs_chmod,
+    fs_operations.chown = fs_chown,
     fs_operations.open = fs_open,
     fs_operations.read = fs_read,
     fs_operations.write = fs_write,
     fs_operations.statfs = fs_statfs,
+    fs_operations.flush = fs_flush,
     fs_operations.release = fs_release,
     fs_operations.opendir = fs_opendir,
     fs_operations.readdir = fs_readdir,
-    fs_operations.releasedir = fs_releasedir;
+    fs_operations.releasedir = fs_releasedir,
+    fs_operations.fsync = fs_fsync,
+    fs_operations.fsyncdir = fs_fsync,
+    fs_operations.destroy = fs_destroy;
 
-    return fuse_main(argc, argv, &fs_operations, NULL);
+    int ret = fuse_main(args.argc, args.argv, &fs_operations, NULL);
+    fuse_opt_free_args(&args);
+    return ret;
 }
+#endif
+
 void *operator new(unsigned long x)
 {
     return malloc(x);
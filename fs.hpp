@@ -11,6 +11,8 @@ extern "C"
 #include <cstddef>
 #include <errno.h>
 #include <fuse.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -18,6 +20,7 @@ extern "C"
 #include <unistd.h>
 
 #include <new>
+#include <type_traits>
 
 #include <numeric>
 #include <vector>
@@ -25,17 +28,24 @@ extern "C"
 
 #include <execinfo.h>
 
-#ifdef DEBUG
-#include <functional>
-#include <iostream>
-#include <string>
-#include <sstream>
+#ifdef __AVX2__
+#include <immintrin.h>
 #endif
 
+#include <string>
+
 #ifndef LOG_LEVEL
 #define LOG_LEVEL LEVEL_INFO
 #endif
 
+#ifndef CACHE_BLOCKS
+#define CACHE_BLOCKS 4096 // upper bound of the block cache, in blocks
+#endif
+
+#ifndef JOURNAL_BLOCKS
+#define JOURNAL_BLOCKS 1024 // size of the metadata journal region, in blocks
+#endif
+
 #ifdef assert
 #undef assert
 #define assert(expr)                          \
@@ -58,57 +68,245 @@ enum
     LEVEL_ERROR
 };
 
-class
+// Levels below LOG_LEVEL, and every level without DEBUG, compile to nothing:
+// the statement after Debug, Info or Error is discarded by if constexpr, so
+// not even its arguments are evaluated
+#ifdef DEBUG
+#define LOG_ENABLED(level) ((level) >= LOG_LEVEL)
+#else
+#define LOG_ENABLED(level) false
+#endif
+
+// Enabled lines are formatted on the caller's stack and queued in a ring that
+// a background thread writes to stderr, so callers never wait on the terminal.
+// A full ring drops lines rather than block, and says how many it dropped.
+class LogSink
 {
 public:
-    class Proxy
+    static inline constexpr int LINES = 4096, LINE_LENGTH = 256;
+
+private:
+    struct Line
     {
-        bool dummy;
-        bool newline;
+        uint64_t sequence; // the ticket it waits for when free, + 1 once written
+        int length;
+        char text[LINE_LENGTH];
+    };
 
-#ifdef DEBUG
-        std::stringstream ss;
-#endif
+    inline static Line lines[LINES];
+    inline static uint64_t head = 0, tail = 0; // next ticket to take, next to write out
+    inline static uint64_t dropped = 0;
+    inline static bool started = false, sleeping = false;
+    inline static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; // one writer at a time
+    inline static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+    inline static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
 
-    public:
-        Proxy(bool dummy) : newline(true), dummy(dummy) {}
-        Proxy(Proxy &&r)
+    // Writes out every line queued so far, true if there was any
+    static bool drain()
+    {
+        char buffer[16 * LINE_LENGTH];
+        size_t used = 0;
+        bool any = false;
+        auto append = [&](const char *text, size_t length) {
+            if (used + length > sizeof(buffer))
+            {
+                write(2, buffer, used);
+                used = 0;
+            }
+            memcpy(buffer + used, text, length);
+            used += length;
+        };
+        for (;; tail++)
         {
-            dummy = r.dummy;
-            newline = r.newline;
-            r.newline = false;
+            auto &&line = lines[tail % LINES];
+            if (__atomic_load_n(&line.sequence, __ATOMIC_ACQUIRE) != tail + 1)
+                break;
+            append(line.text, line.length);
+            __atomic_store_n(&line.sequence, tail + LINES, __ATOMIC_RELEASE);
+            any = true;
         }
-        ~Proxy()
+        if (uint64_t lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED))
         {
-#ifdef DEBUG
-            std::cerr << ss.str();
-            if (!dummy && newline)
-                std::cerr << std::endl;
-            std::cerr.flush();
-#endif
+            char note[64];
+            append(note, snprintf(note, sizeof(note), "(%lu log lines dropped)\n", (unsigned long)lost));
         }
-        template <typename T>
-        Proxy &operator<<(const T &r)
+        if (used)
+            write(2, buffer, used);
+        return any;
+    }
+
+    static void *run(void *)
+    {
+        for (;;)
         {
-#ifdef DEBUG
-            if (!dummy)
-                ss << r << " ";
-#endif
-            return *this;
+            pthread_mutex_lock(&lock);
+            if (!drain())
+            {
+                __atomic_store_n(&sleeping, true, __ATOMIC_SEQ_CST);
+                if (__atomic_load_n(&lines[tail % LINES].sequence, __ATOMIC_SEQ_CST) != tail + 1)
+                {
+                    timespec until;
+                    clock_gettime(CLOCK_REALTIME, &until);
+                    until.tv_nsec += 100 * 1000 * 1000;
+                    if (until.tv_nsec >= 1000 * 1000 * 1000)
+                        until.tv_sec++, until.tv_nsec -= 1000 * 1000 * 1000;
+                    pthread_cond_timedwait(&wake, &lock, &until);
+                }
+                __atomic_store_n(&sleeping, false, __ATOMIC_SEQ_CST);
+            }
+            pthread_mutex_unlock(&lock);
         }
-    };
-    Proxy operator()(int level)
+        return nullptr;
+    }
+
+    static void flush()
+    {
+        pthread_mutex_lock(&lock);
+        drain();
+        pthread_mutex_unlock(&lock);
+    }
+
+    // The writer thread does not survive the fork into a daemon
+    static void forked()
+    {
+        lock = PTHREAD_MUTEX_INITIALIZER;
+        start_lock = PTHREAD_MUTEX_INITIALIZER;
+        started = false;
+    }
+
+    static void start()
+    {
+        pthread_mutex_lock(&start_lock);
+        if (!started)
+        {
+            static bool once = false;
+            if (!once)
+            {
+                once = true;
+                for (int i = 0; i < LINES; i++)
+                    lines[i].sequence = i;
+                atexit(flush);
+                pthread_atfork(nullptr, nullptr, forked);
+            }
+            pthread_t thread;
+            if (pthread_create(&thread, nullptr, run, nullptr) == 0)
+            {
+                pthread_detach(thread);
+                __atomic_store_n(&started, true, __ATOMIC_RELEASE);
+            }
+        }
+        pthread_mutex_unlock(&start_lock);
+    }
+
+public:
+    static void push(const char *text, int length)
+    {
+        if (!__atomic_load_n(&started, __ATOMIC_ACQUIRE))
+            start();
+        uint64_t ticket = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        for (;;)
+        {
+            auto &&line = lines[ticket % LINES];
+            uint64_t sequence = __atomic_load_n(&line.sequence, __ATOMIC_ACQUIRE);
+            if (sequence < ticket)
+            {
+                __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+                return;
+            }
+            if (sequence == ticket &&
+                __atomic_compare_exchange_n(&head, &ticket, ticket + 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                memcpy(line.text, text, length);
+                line.length = length;
+                __atomic_store_n(&line.sequence, ticket + 1, __ATOMIC_SEQ_CST);
+                break;
+            }
+            if (sequence != ticket)
+                ticket = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        }
+        if (__atomic_load_n(&sleeping, __ATOMIC_SEQ_CST))
+        {
+            pthread_mutex_lock(&lock);
+            pthread_cond_signal(&wake);
+            pthread_mutex_unlock(&lock);
+        }
+    }
+};
+
+// One log line: every item is followed by a space, the line by a newline
+class LogLine
+{
+    char text[LogSink::LINE_LENGTH];
+    int length = 0;
+
+    // Long lines are cut, keeping room for the newline
+    LogLine &append(const char *data, size_t size)
+    {
+        int room = sizeof(text) - 1 - length;
+        if (room <= 0)
+            return *this;
+        size = std::min<size_t>(size, room - 1);
+        memcpy(text + length, data, size);
+        length += size;
+        text[length++] = ' ';
+        return *this;
+    }
+
+public:
+    LogLine() = default;
+    LogLine(const LogLine &) = delete;
+
+    ~LogLine()
     {
-        if (level < LOG_LEVEL)
-            return Proxy(true);
+        text[length++] = '\n';
+        LogSink::push(text, length);
+    }
+
+    template <typename T>
+    LogLine &operator<<(const T &r)
+    {
+        char number[32];
+        if constexpr (std::is_same_v<T, bool>)
+            return append(r ? "true" : "false", r ? 4 : 5);
+        else if constexpr (std::is_integral_v<T> || std::is_enum_v<T>)
+        {
+            if constexpr (std::is_signed_v<T> || std::is_enum_v<T>)
+                return append(number, snprintf(number, sizeof(number), "%lld", (long long)r));
+            else
+                return append(number, snprintf(number, sizeof(number), "%llu", (unsigned long long)r));
+        }
+        else if constexpr (std::is_floating_point_v<T>)
+            return append(number, snprintf(number, sizeof(number), "%g", (double)r));
+        else if constexpr (std::is_convertible_v<const T &, const char *>)
+        {
+            const char *string = r;
+            return string ? append(string, strlen(string)) : append("(null)", 6);
+        }
+        else if constexpr (std::is_pointer_v<T>)
+            return append(number, snprintf(number, sizeof(number), "%p", (const void *)r));
         else
-            return Proxy(false);
+            return append(r.data(), r.size());
     }
-} inline Logger;
+};
 
-#define Debug Logger(LEVEL_DEBUG) << __PRETTY_FUNCTION__ << " "
-#define Info Logger(LEVEL_INFO) << __PRETTY_FUNCTION__ << " "
-#define Error Logger(LEVEL_ERROR) << __PRETTY_FUNCTION__ << " "
+#define Debug                                \
+    if constexpr (!LOG_ENABLED(LEVEL_DEBUG)) \
+    {                                        \
+    }                                        \
+    else                                     \
+        LogLine() << __PRETTY_FUNCTION__
+#define Info                                \
+    if constexpr (!LOG_ENABLED(LEVEL_INFO)) \
+    {                                       \
+    }                                       \
+    else                                    \
+        LogLine() << __PRETTY_FUNCTION__
+#define Error                                \
+    if constexpr (!LOG_ENABLED(LEVEL_ERROR)) \
+    {                                        \
+    }                                        \
+    else                                     \
+        LogLine() << __PRETTY_FUNCTION__
 #define Show(x) (#x) << "=" << (x)
 
 template <typename Function>
@@ -134,6 +332,40 @@ public:
     }
 };
 
+// A pthread mutex that needs no init call, so it can sit in static arrays
+struct Mutex
+{
+    pthread_mutex_t native = PTHREAD_MUTEX_INITIALIZER;
+};
+
+// Scoped pthread locks
+class MutexLock
+{
+    Mutex &lock;
+
+public:
+    MutexLock(Mutex &lock) : lock(lock) { pthread_mutex_lock(&lock.native); }
+    ~MutexLock() { pthread_mutex_unlock(&lock.native); }
+};
+
+class ReadLock
+{
+    pthread_rwlock_t &lock;
+
+public:
+    ReadLock(pthread_rwlock_t &lock) : lock(lock) { pthread_rwlock_rdlock(&lock); }
+    ~ReadLock() { pthread_rwlock_unlock(&lock); }
+};
+
+class WriteLock
+{
+    pthread_rwlock_t &lock;
+
+public:
+    WriteLock(pthread_rwlock_t &lock) : lock(lock) { pthread_rwlock_wrlock(&lock); }
+    ~WriteLock() { pthread_rwlock_unlock(&lock); }
+};
+
 template <class T>
 class malloc_allocator
 {
@@ -170,6 +402,29 @@ public:
     void destroy(pointer p) { p->~value_type(); }
 };
 
+struct Options
+{
+    enum
+    {
+        STRICTATIME,
+        RELATIME, // only when atime is not newer than mtime/ctime, or a day old
+        NOATIME,
+    };
+    int format; // always run mkfs instead of mounting the existing filesystem
+    int atime;  // when reads update the access time
+    int lowlevel; // serve the inode based FUSE API instead of the path based one
+    int blocks;   // size of a filesystem mkfs makes, 0 for the size of the disk
+} inline options;
+
+// Tag for a BlockProxy whose block is about to be overwritten in full: its
+// contents are left undefined instead of read from the disk.
+inline constexpr struct Overwrite
+{
+} overwrite;
+
+// BlockProxy<const T> is a read-only view of a block: it never needs commit()
+// or drop(), and on a memory mapped disk it points straight at the mapping
+// instead of copying the block out.
 template <class BlockType>
 class BlockProxy
 {
@@ -179,6 +434,7 @@ public:
         BlockType data;
         uint8_t padding[BLOCK_SIZE - sizeof(BlockType)];
     };
+    static inline constexpr bool readonly = std::is_const_v<BlockType>;
 
 private:
     bool closed;
@@ -186,17 +442,44 @@ private:
     int blockno;
     typename std::aligned_storage<sizeof(value_type), 8>::type data_storage;
 
+    value_type &storage()
+    {
+        return reinterpret_cast<value_type &>(data_storage);
+    }
+
+    bool is_mapped() const
+    {
+        return &block != reinterpret_cast<const value_type *>(&data_storage);
+    }
+
+    static value_type *locate(int blockno);
+
 public:
     value_type &block;
 
-    BlockProxy() : error(1), closed(1), blockno(-1), block(reinterpret_cast<value_type &>(data_storage)) {}
+    BlockProxy() : error(1), closed(1), blockno(-1), block(storage()) {}
 
     BlockProxy(int blockno);
 
+    BlockProxy(int blockno, Overwrite) : closed(false), error(false), blockno(blockno), block(storage())
+    {
+        static_assert(!readonly, "read-only blocks can't be overwritten");
+        assert(blockno >= 0 && blockno < disk_blocks());
+    }
+
+    BlockProxy(const BlockProxy &r)
+        : closed(r.closed), error(r.error), blockno(r.blockno), block(r.is_mapped() ? r.block : storage())
+    {
+        if (!is_mapped())
+            memcpy(&block, &r.block, sizeof(value_type));
+    }
+
     ~BlockProxy()
     {
         if (!closed)
+        {
             Error << "Unexpected destruct";
+        }
     }
 
     BlockType &operator*()
@@ -258,19 +541,37 @@ public:
     enum class INodeType
     {
         FILE,
-        DIRECTORY
+        DIRECTORY,
+        DIRECTORY_INDEX // name hash index of a directory, not linked anywhere
     };
+    // Files of up to INLINE_SIZE bytes keep their data in the inode, in place
+    // of the block pointers, and own no data block; the rest of the inline
+    // area stays zero
+    static inline constexpr int INLINE_SIZE = 100;
     struct INode
     {
         INodeType type;
-        uint32_t filesize;
+        union
+        {
+            uint32_t index_inode;   // directories only, 0 when there is no index
+            uint32_t index_entries; // DIRECTORY_INDEX only, the names it holds
+        };
+        uint64_t filesize;
         uint32_t atime;
         uint32_t mtime;
         uint32_t ctime;
-        uint32_t direct_pointer;
-        uint32_t indirect_pointer;
-        uint32_t iindirect_pointer;
+        union
+        {
+            struct
+            {
+                uint32_t direct_pointer;
+                uint32_t indirect_pointer;
+                uint32_t iindirect_pointer;
+            };
+            char inline_data[INLINE_SIZE];
+        };
     };
+    static_assert(sizeof(INode) == 128);
     static inline constexpr uint32_t INODE_IN_BLOCK = BLOCK_SIZE / sizeof(INode);
 
     INode inodes[INODE_IN_BLOCK];
@@ -283,12 +584,12 @@ public:
     using value_type = uint64_t;
     value_type data[BLOCK_SIZE / sizeof(value_type)];
 
-    std::pair<int, int> unpack(int pos)
+    std::pair<int, int> unpack(int pos) const
     {
         return {pos / (sizeof(value_type) * 8), pos % (sizeof(value_type) * 8)};
     }
 
-    int pack(int block, int offset)
+    int pack(int block, int offset) const
     {
         return block * (sizeof(value_type) * 8) + offset;
     }
@@ -307,7 +608,7 @@ public:
         data[block] = data[block] & ~(value_type(1) << offset);
     }
 
-    bool get(int pos)
+    bool get(int pos) const
     {
         auto [block, offset] = unpack(pos);
         bool ret = data[block] & (value_type(1) << offset);
@@ -315,7 +616,66 @@ public:
         return ret;
     }
 
-    int get_first_zero(int pos = 0)
+    static inline constexpr int WORDS = BLOCK_SIZE / sizeof(value_type);
+
+    // Sets bit i of nonfull when data[i] still has a zero in it
+    void summarize(uint64_t *nonfull) const
+    {
+        memset(nonfull, 0, WORDS / 8);
+#ifdef __AVX2__
+        const __m256i ones = _mm256_set1_epi64x(-1);
+        for (int i = 0; i < WORDS; i += 4)
+        {
+            auto now = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+            int full = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(now, ones)));
+            nonfull[i / 64] |= uint64_t(~full & 0xf) << (i % 64);
+        }
+#else
+        for (int i = 0; i < WORDS; i++)
+            if (~data[i])
+                nonfull[i / 64] |= uint64_t(1) << (i % 64);
+#endif
+    }
+
+    int count_free() const
+    {
+        int ret = 0;
+        for (auto &&now : data)
+            ret += __builtin_popcountll(~now);
+        return ret;
+    }
+
+    // Length of the run of zeros starting at pos, capped at limit
+    int count_zero(int pos, int limit) const
+    {
+        int count = 0;
+        while (count < limit && pos < BLOCK_SIZE * 8)
+        {
+            auto [block, offset] = unpack(pos);
+            auto now = data[block] >> offset;
+            int run = now ? __builtin_ctzll(now) : int(sizeof(value_type) * 8) - offset;
+            count += run;
+            pos += run;
+            if (now)
+                break;
+        }
+        return std::min(count, limit);
+    }
+
+    void set_run(int pos, int count)
+    {
+        while (count)
+        {
+            auto [block, offset] = unpack(pos);
+            int bits = std::min<int>(count, sizeof(value_type) * 8 - offset);
+            auto mask = bits == sizeof(value_type) * 8 ? ~value_type(0) : ((value_type(1) << bits) - 1) << offset;
+            data[block] = data[block] | mask;
+            pos += bits;
+            count -= bits;
+        }
+    }
+
+    int get_first_zero(int pos = 0) const
     {
         for (int block = unpack(pos).first; block < BLOCK_SIZE / sizeof(value_type); block++)
         {
@@ -331,12 +691,59 @@ public:
     }
 };
 
+// In-memory picture of one on-disk bitmap, built at mount: a free count per
+// bitmap block and a bit per word that is not full, so finding a zero only
+// reads the one bitmap block that has it
+struct FreeSummary
+{
+    struct Entry
+    {
+        int free;
+        uint64_t nonfull[BitmapBlock::WORDS / 64];
+    };
+
+    std::vector<Entry, malloc_allocator<Entry>> blocks;
+
+    void build(int start, int end);
+
+    // Refresh words [first, last] of a bitmap block after free changed by delta
+    void update(int blockno, const BitmapBlock &block, int first, int last, int delta)
+    {
+        auto &&entry = blocks[blockno];
+        entry.free += delta;
+        for (int i = first; i <= last; i++)
+        {
+            auto bit = uint64_t(1) << (i % 64);
+            entry.nonfull[i / 64] = ~block.data[i] ? entry.nonfull[i / 64] | bit : entry.nonfull[i / 64] & ~bit;
+        }
+    }
+
+    // First non-full word of a bitmap block at or after word, -1 if none
+    int find(int blockno, int word) const
+    {
+        auto &&entry = blocks[blockno];
+        if (entry.free == 0)
+            return -1;
+        for (int i = word / 64; i < BitmapBlock::WORDS / 64; i++)
+        {
+            auto now = entry.nonfull[i];
+            if (i == word / 64)
+                now &= ~uint64_t(0) << (word % 64);
+            if (now)
+                return i * 64 + __builtin_ctzll(now);
+        }
+        return -1;
+    }
+};
+
 struct BitMap
 {
     static inline constexpr uint32_t siz = BLOCK_SIZE * 8;
     int minpos;
     int start, end, size;
-    BitMap(int start, int end, int minpos = 0) : start(start), end(end), size((end - start) * siz), minpos(minpos) {}
+    FreeSummary &summary;
+    BitMap(int start, int end, FreeSummary &summary, int minpos = 0)
+        : start(start), end(end), size((end - start) * siz), summary(summary), minpos(minpos) {}
 
     std::pair<int, int> unpack(int pos)
     {
@@ -355,6 +762,11 @@ struct BitMap
     bool get(int pos);
 
     int get_first_zero();
+
+    // Both stay inside the bitmap block holding pos
+    int get_zero_run(int pos, int limit);
+
+    void set_run(int pos, int count);
 };
 
 struct PointerBlock
@@ -371,146 +783,1748 @@ struct DataBlock
     char data[BLOCK_SIZE];
 };
 
+// Entries are variable length records packed from the start of each data
+// block, or of the inline area of a short directory, and never span two
+// blocks; a zero name length ends a block early and no block is left empty.
+// Positions are byte offsets into the directory.
+//
+// Directories of more than INDEX_THRESHOLD blocks also get an on-disk open
+// addressing hash table from name hashes to the blocks holding them, kept in
+// a separate DIRECTORY_INDEX inode, so lookup, push and erase don't scan
+// every entry. Below that a scan of the cached blocks is cheaper than the
+// index blocks every push and erase would journal; a directory shrunk to half
+// the threshold drops its index.
 struct DirectoryProxy
 {
 public:
+    static inline constexpr int NAME_LENGTH = 255;
+
     int inodeno;
     struct Item
     {
         uint32_t file_inode;
-        char filename[28];
+        uint32_t hash; // of the name, compared before the name itself
+        uint8_t name_length;
+        char filename[NAME_LENGTH + 1]; // only name_length + 1 bytes are stored
+
+        Item() = default;
+        Item(uint32_t file_inode, const char *name)
+            : file_inode(file_inode), hash(DirectoryProxy::hash(name)), name_length(strlen(name))
+        {
+            memcpy(filename, name, name_length + 1);
+        }
+
+        // Bytes the record takes, kept a multiple of 4
+        int size() const
+        {
+            return (offsetof(Item, filename) + name_length + 1 + 3) & ~3;
+        }
+
+        bool is(uint32_t hash, const char *name) const
+        {
+            return this->hash == hash && !strcmp(filename, name);
+        }
     };
-    static_assert(sizeof(DirectoryProxy::Item) == 32);
+    static_assert(offsetof(Item, filename) == 9);
+    static inline constexpr int MIN_ITEM = (offsetof(Item, filename) + 2 + 3) & ~3;
+    static inline constexpr int INDEX_THRESHOLD = 8;
+    static_assert(INDEX_THRESHOLD / 2 >= 1, "a directory going inline must have dropped its index");
+
+    // Walks the entries in place, reading each data block once:
+    // for (auto &&item : directory) ...
+    class iterator
+    {
+        int inodeno, offset, limit; // limit is the directory size
+        bool inlined; // short directories keep their entries in the inode
+        BlockProxy<const DataBlock> block;
+        char inline_data[INodeBlock::INLINE_SIZE];
 
-    DirectoryProxy(int inodeno) : inodeno(inodeno) {}
+        void load();
+        void settle();
 
-    int length();
-    void set(int index, DirectoryProxy::Item item);
-    DirectoryProxy::Item get(int index);
-    int push(DirectoryProxy::Item file);
-    void erase(int index);
-};
+    public:
+        iterator(int inodeno, int offset, int limit)
+            : inodeno(inodeno), offset(offset), limit(limit), inlined(false)
+        {
+            if (offset < limit)
+            {
+                load();
+                settle();
+            }
+        }
 
-struct HeaderBlock
-{
-public:
-    inline static constexpr int bias = 1024;
-    static inline constexpr uint32_t MAGIC_NUMBER_VAL = 0x19260817;
-    uint32_t MAGIC_NUMBER;
-    uint32_t inode_num_tot;
-    uint32_t inode_num_free;
-    uint32_t inode_bitmap_offset; // in block
-    uint32_t inode_block_offset;  // in block
-    uint32_t data_block_num_tot;
-    uint32_t data_block_num_free;
-    uint32_t data_block_bitmap_offset; // in block
-    uint32_t data_block_offset;        // in block
+        const Item &operator*() const
+        {
+            const char *base = inlined ? inline_data : block->data;
+            return *reinterpret_cast<const Item *>(base + offset % BLOCK_SIZE);
+        }
+
+        const Item *operator->() const
+        {
+            return &**this;
+        }
+
+        iterator &operator++()
+        {
+            int blockno = offset / BLOCK_SIZE;
+            offset += (**this).size();
+            if (!inlined && offset / BLOCK_SIZE != blockno && offset < limit)
+                load(); // the record filled its block
+            settle();
+            return *this;
+        }
+
+        bool operator!=(const iterator &r) const
+        {
+            return offset != r.offset;
+        }
 
-    HeaderBlock()
-        : MAGIC_NUMBER(MAGIC_NUMBER_VAL)
+        int position() const
+        {
+            return offset;
+        }
+    };
+
+    DirectoryProxy(int inodeno) : inodeno(inodeno) {}
+
+    iterator begin()
     {
-#define DIVIDE_CEIL(x, y) (((x) + (y)-1) / (y))
-        uint32_t avail_block_num = BLOCK_NUM - 1;
-        uint32_t inode_blocks = avail_block_num / INodeBlock::INODE_IN_BLOCK;
-        inode_num_free = inode_num_tot = inode_blocks * INodeBlock::INODE_IN_BLOCK;
-        uint32_t inode_bitmap_blocks = DIVIDE_CEIL(inode_num_tot, BLOCK_SIZE * 8);
-        inode_bitmap_offset = 1;
-        data_block_bitmap_offset = inode_bitmap_offset + inode_bitmap_blocks;
-        avail_block_num -= inode_blocks + inode_bitmap_blocks;
-        uint32_t data_block_bitmap_blocks = DIVIDE_CEIL(avail_block_num, BLOCK_SIZE * 8);
-        data_block_num_free = data_block_num_tot = avail_block_num - data_block_bitmap_blocks;
-        inode_block_offset = data_block_bitmap_offset + data_block_bitmap_blocks;
-        data_block_offset = inode_block_offset + inode_blocks;
+        return iterator(inodeno, 0, size());
+    }
 
-#undef DIVIDE_CEIL
+    iterator end()
+    {
+        int size = this->size();
+        return iterator(inodeno, size, size);
+    }
+
+    static uint32_t hash(const char *name)
+    {
+        uint32_t ret = 2166136261u; // FNV-1a
+        for (; *name; name++)
+            ret = (ret ^ uint8_t(*name)) * 16777619u;
+        return ret;
     }
+
+    int size();
+    DirectoryProxy::Item get(int position);
+    int find(const char *filename);
+    int push(const DirectoryProxy::Item &item);
+    void erase(int position);
+    void remove_index();
+
+private:
+    struct IndexSlot
+    {
+        uint32_t hash;
+        uint32_t position; // block of the item + 1, 0 for an empty slot
+    };
+    static inline constexpr int INDEX_SLOT_IN_BLOCK = BLOCK_SIZE / sizeof(IndexSlot);
+
+    static int used(const char *data, int size);
+    int index_inode();
+    int index_capacity(int index);
+    int index_entries(int index);
+    void index_count(int index, int delta);
+    IndexSlot index_get(int index, int slot);
+    void index_set(int index, int slot, IndexSlot value);
+    int index_find(int index, const char *filename);
+    int index_slot(int index, uint32_t hash, uint32_t position);
+    void index_insert(int index, uint32_t hash, uint32_t position);
+    void index_erase(int index, uint32_t hash, uint32_t position);
+    void index_move(int index, uint32_t hash, uint32_t from, uint32_t to);
+    int index_rebuild();
 };
 
-struct INodeProxy
+// Remembers name lookups: (parent inode, name) -> child inode, or -1 for a name
+// known to be absent. A small table of recently resolved full paths sits in
+// front of it; those entries are dropped wholesale by invalidate_paths(),
+// since a rename or delete can change what any of them resolves to.
+class DentryCache
 {
-    bool closed;
-    bool error;
-    int inodeno;
-    INodeBlock::INode inode;
+    static inline constexpr int SETS = 1024, WAYS = 4;
+    static inline constexpr int NAME_LENGTH = 72; // longer names are not cached
+    static inline constexpr int PATHS = 256, PATH_LENGTH = 256;
+    static inline constexpr int STRIPES = 64; // locks, by set and by path slot
 
-    INodeProxy(int inodeno);
-    ~INodeProxy()
+    struct Entry
     {
-        if (!closed)
-            Info << "Unexpected destruct";
-    }
+        uint32_t hash; // 0 for an unused entry
+        int parent;
+        int inode;
+        char name[NAME_LENGTH];
+    };
 
-    INodeBlock::INode &operator*()
+    struct PathEntry
     {
-        return inode;
-    }
+        uint64_t generation;
+        uint32_t hash;
+        int inode;
+        char path[PATH_LENGTH];
+    };
 
-    INodeBlock::INode *operator->()
+    inline static Entry entries[SETS][WAYS];
+    inline static PathEntry paths[PATHS];
+    inline static uint64_t generation = 1;
+    inline static Mutex locks[STRIPES];
+
+    static uint32_t hash(int parent, const char *name)
     {
-        return &inode;
+        return (DirectoryProxy::hash(name) ^ (uint32_t(parent) * 2654435761u)) | 1;
     }
 
-    operator bool()
+    static Entry *find(int parent, const char *name, uint32_t hash)
     {
-        return error;
+        for (auto &&entry : entries[hash % SETS])
+            if (entry.hash == hash && entry.parent == parent && !strcmp(entry.name, name))
+                return &entry;
+        return nullptr;
     }
 
-    void apply();
-    void commit()
+public:
+    // Returns false on a miss, otherwise inode is the cached answer (maybe -1)
+    static bool lookup(int parent, const char *name, int &inode)
     {
-        apply();
-        if (!error)
-            closed = true;
+        auto h = hash(parent, name);
+        MutexLock _(locks[h % SETS % STRIPES]);
+        auto entry = find(parent, name, h);
+        if (entry == nullptr)
+            return false;
+        inode = entry->inode;
+        return true;
     }
-    auto &&drop()
+
+    static void insert(int parent, const char *name, int inode)
     {
-        closed = true;
+        if (strlen(name) >= NAME_LENGTH)
+            return;
+        auto h = hash(parent, name);
+        MutexLock _(locks[h % SETS % STRIPES]);
+        auto entry = find(parent, name, h);
+        if (entry == nullptr)
+        {
+            auto &&set = entries[h % SETS];
+            entry = &set[(h / SETS) % WAYS];
+            for (auto &&way : set)
+                if (way.hash == 0)
+                {
+                    entry = &way;
+                    break;
+                }
+        }
+        entry->hash = h;
+        entry->parent = parent;
+        entry->inode = inode;
+        strcpy(entry->name, name);
+    }
+
+    // Drops every entry naming the inode or living in it, once it is freed
+    static void forget(int inode)
+    {
+        for (int stripe = 0; stripe < STRIPES; stripe++)
+        {
+            MutexLock _(locks[stripe]);
+            for (int set = stripe; set < SETS; set += STRIPES)
+                for (auto &&entry : entries[set])
+                    if (entry.hash && (entry.parent == inode || entry.inode == inode))
+                        entry.hash = 0;
+        }
+        invalidate_paths();
+    }
+
+    static bool lookup_path(const char *path, int &inode)
+    {
+        auto h = hash(-1, path);
+        MutexLock _(locks[h % PATHS % STRIPES]);
+        auto &&entry = paths[h % PATHS];
+        if (entry.generation != current_generation() || entry.hash != h || strcmp(entry.path, path))
+            return false;
+        inode = entry.inode;
+        return true;
+    }
+
+    // generation is current_generation() from before the walk that found inode,
+    // so a rename racing with the walk leaves the entry already stale
+    static void insert_path(const char *path, int inode, uint64_t generation)
+    {
+        if (strlen(path) >= PATH_LENGTH)
+            return;
+        auto h = hash(-1, path);
+        MutexLock _(locks[h % PATHS % STRIPES]);
+        auto &&entry = paths[h % PATHS];
+        entry.generation = generation;
+        entry.hash = h;
+        entry.inode = inode;
+        strcpy(entry.path, path);
+    }
+
+    static uint64_t current_generation()
+    {
+        return __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+    }
+
+    static void invalidate_paths()
+    {
+        __atomic_fetch_add(&generation, 1, __ATOMIC_ACQ_REL);
+    }
+};
+
+// The disk holds the superblock, the journal, the inode and the data bitmaps,
+// then block groups: an inode table and the data blocks next to it. Each group
+// owns one block of each bitmap, bit i of group g being bit g * GROUP_BITS + i,
+// the bits past its end set at mkfs; inodes are numbered densely, as every
+// group but a lone one has GROUP_BITS of them.
+struct HeaderBlock
+{
+public:
+    inline static constexpr int bias = 1024;
+    // The magic marks a disk as ours in every format, the version tells the
+    // format apart; bump it with every change to what the disk holds. Disks
+    // from before the field carry their inode count in its place
+    static inline constexpr uint32_t MAGIC_NUMBER_VAL = 0x19260817;
+    static inline constexpr uint32_t FORMAT_VERSION = 2;
+    static inline constexpr uint32_t GROUP_BITS = BLOCK_SIZE * 8;
+    static inline constexpr uint32_t MIN_BLOCKS = 256;
+    static inline constexpr int ORPHAN_SLOTS = BLOCK_SIZE / sizeof(uint32_t) - 32; // the fields above take the rest
+    uint32_t MAGIC_NUMBER;
+    uint32_t format_version;
+    uint32_t inode_num_tot;
+    uint32_t inode_num_free;
+    uint32_t inode_bitmap_offset; // in block
+    uint32_t data_block_num_tot;
+    uint32_t data_block_num_free;
+    uint32_t data_block_bitmap_offset; // in block
+    uint32_t journal_offset;           // in block
+    uint32_t journal_blocks;
+    uint32_t block_size; // of the build that formatted the disk
+    uint32_t block_num;  // size of the filesystem, in blocks
+    uint32_t group_offset; // in block
+    uint32_t group_num;
+    uint32_t group_blocks;       // the last group may be shorter
+    uint32_t group_inode_blocks; // at the start of every group
+    // Inodes unlinked while still open, freed by the next mount if a crash
+    // came first; like the free counters, not part of the layout
+    uint32_t orphan_num = 0;
+    uint32_t orphans[ORPHAN_SLOTS] = {};
+
+    // The layout follows from the size alone; blocks is at least MIN_BLOCKS
+    HeaderBlock(uint32_t blocks = BLOCK_NUM)
+        : MAGIC_NUMBER(MAGIC_NUMBER_VAL), format_version(FORMAT_VERSION), block_size(BLOCK_SIZE), block_num(blocks)
+    {
+#define DIVIDE_CEIL(x, y) (((x) + (y)-1) / (y))
+        journal_offset = 1;
+        journal_blocks = std::min<uint32_t>(JOURNAL_BLOCKS, blocks / 16);
+        // A group costs its own blocks and one block of each bitmap
+        uint32_t avail_block_num = blocks - 1 - journal_blocks;
+        group_blocks = std::min(GROUP_BITS, avail_block_num - 2);
+        group_inode_blocks = DIVIDE_CEIL(group_blocks, INodeBlock::INODE_IN_BLOCK);
+        group_num = avail_block_num / (group_blocks + 2);
+        uint32_t last_blocks = group_blocks;
+        if (avail_block_num % (group_blocks + 2) > group_inode_blocks + 2)
+        {
+            last_blocks = avail_block_num % (group_blocks + 2) - 2;
+            group_num++;
+        }
+        inode_bitmap_offset = journal_offset + journal_blocks;
+        data_block_bitmap_offset = inode_bitmap_offset + group_num;
+        group_offset = data_block_bitmap_offset + group_num;
+        inode_num_free = inode_num_tot = group_num * group_inodes();
+        data_block_num_free = data_block_num_tot = (group_num - 1) * (group_blocks - group_inode_blocks) + last_blocks - group_inode_blocks;
+#undef DIVIDE_CEIL
+    }
+
+    bool same_layout(const HeaderBlock &r) const
+    {
+        return inode_num_tot == r.inode_num_tot && inode_bitmap_offset == r.inode_bitmap_offset &&
+               data_block_num_tot == r.data_block_num_tot && data_block_bitmap_offset == r.data_block_bitmap_offset &&
+               journal_offset == r.journal_offset && journal_blocks == r.journal_blocks && block_size == r.block_size &&
+               block_num == r.block_num && group_offset == r.group_offset && group_num == r.group_num &&
+               group_blocks == r.group_blocks && group_inode_blocks == r.group_inode_blocks;
+    }
+
+    // Whether this is the superblock of a filesystem this build can mount
+    bool valid() const
+    {
+        return MAGIC_NUMBER == MAGIC_NUMBER_VAL && format_version == FORMAT_VERSION && block_size == BLOCK_SIZE && block_num >= MIN_BLOCKS &&
+               block_num <= INT_MAX && same_layout(HeaderBlock(block_num)) && orphan_num <= uint32_t(ORPHAN_SLOTS);
+    }
+
+    uint32_t group_inodes() const
+    {
+        return group_inode_blocks * INodeBlock::INODE_IN_BLOCK;
+    }
+
+    uint32_t group_data(uint32_t group) const
+    {
+        uint32_t full = group_blocks - group_inode_blocks;
+        return group + 1 < group_num ? full : data_block_num_tot - (group_num - 1) * full;
+    }
+
+    int group_start(uint32_t group) const
+    {
+        return group_offset + group * group_blocks;
+    }
+
+    // Group of a block past group_offset, group_num and up for the unused tail
+    uint32_t group_of(int blockno) const
+    {
+        return (blockno - group_offset) / group_blocks;
+    }
+
+    int inode_block(int inodeno) const
+    {
+        return group_start(inodeno / group_inodes()) + inodeno % group_inodes() / INodeBlock::INODE_IN_BLOCK;
+    }
+
+    // Data bitmap bit to block and back
+    int data_block(int datano) const
+    {
+        return group_start(datano / GROUP_BITS) + group_inode_blocks + datano % GROUP_BITS;
+    }
+
+    int data_no(int blockno) const
+    {
+        uint32_t group = group_of(blockno);
+        return group * GROUP_BITS + blockno - group_start(group) - group_inode_blocks;
+    }
+};
+
+static_assert(sizeof(HeaderBlock) <= BLOCK_SIZE);
+
+// The journal region holds its own header in its first block, then
+// transactions back to back: one or more descriptors, each followed by the
+// images of the blocks it lists, and a commit record. Each record is one block.
+struct JournalRecord
+{
+    static inline constexpr uint32_t HEADER = 0x4a524e4c, DESCRIPTOR = 0x4a445343, COMMIT = 0x4a434d54;
+    static inline constexpr int BLOCKS_PER_TRANSACTION = BLOCK_SIZE / 4 - 3;
+    uint32_t magic;
+    uint32_t sequence; // HEADER: the first transaction to replay
+    union
+    {
+        uint32_t start;    // HEADER: where that transaction begins, in blocks into the region
+        uint32_t count;    // DESCRIPTOR
+        uint32_t checksum; // COMMIT: of the logged images
+    };
+    uint32_t blocknos[BLOCKS_PER_TRANSACTION]; // DESCRIPTOR
+
+    // The checksum of a transaction's images, taken one descriptor's worth at
+    // a time: state starts at the sequence, the commit holds fold(state)
+    static uint64_t hash(uint64_t state, const iovec *iov, int count)
+    {
+        for (int i = 0; i < count; i++)
+            for (auto word = static_cast<const uint64_t *>(iov[i].iov_base), end = word + BLOCK_SIZE / 8; word != end; word++)
+                state = (state ^ *word) * 0x100000001b3ull;
+        return state;
+    }
+
+    static uint32_t fold(uint64_t state)
+    {
+        return state ^ state >> 32;
+    }
+
+    // Journal blocks a transaction of count images takes
+    static int blocks(int count)
+    {
+        return (count + BLOCKS_PER_TRANSACTION - 1) / BLOCKS_PER_TRANSACTION + count + 1;
+    }
+};
+static_assert(sizeof(JournalRecord) == BLOCK_SIZE);
+
+struct INodeProxy
+{
+    bool closed;
+    bool error;
+    int inodeno;
+    INodeBlock::INode inode;
+
+    INodeProxy(int inodeno);
+    ~INodeProxy()
+    {
+        if (!closed)
+        {
+            Info << "Unexpected destruct";
+        }
+    }
+
+    INodeBlock::INode &operator*()
+    {
+        return inode;
+    }
+
+    INodeBlock::INode *operator->()
+    {
+        return &inode;
+    }
+
+    operator bool()
+    {
+        return error;
+    }
+
+    // Stamp a read by the user under the atime option, true if the inode changed
+    bool access();
+
+    void apply();
+    void commit()
+    {
+        apply();
+        if (!error)
+            closed = true;
+    }
+    auto &&drop()
+    {
+        closed = true;
         return *this;
     }
-};
+};
+
+// Remembers (inode, data block index) -> block number so sequential I/O skips
+// the inode and pointer blocks; resize drops entries as it frees blocks
+class BlockMap
+{
+    static inline constexpr int ENTRIES = 1 << 14, STRIPES = 64;
+
+    struct Entry
+    {
+        int inodeno;
+        int datano;
+        int blockno; // 0 for an unused entry, data never lives in block 0
+    };
+
+    inline static Entry entries[ENTRIES];
+    inline static Mutex locks[STRIPES];
+
+    static int slot(int inodeno, int datano)
+    {
+        return (uint32_t(inodeno) * 2654435761u + datano) % ENTRIES;
+    }
+
+public:
+    // Returns 0 on a miss
+    static int lookup(int inodeno, int datano)
+    {
+        int now = slot(inodeno, datano);
+        MutexLock _(locks[now % STRIPES]);
+        auto &&entry = entries[now];
+        return entry.inodeno == inodeno && entry.datano == datano ? entry.blockno : 0;
+    }
+
+    static void insert(int inodeno, int datano, int blockno)
+    {
+        int now = slot(inodeno, datano);
+        MutexLock _(locks[now % STRIPES]);
+        entries[now] = {inodeno, datano, blockno};
+    }
+
+    static void forget(int inodeno, int datano)
+    {
+        int now = slot(inodeno, datano);
+        MutexLock _(locks[now % STRIPES]);
+        auto &&entry = entries[now];
+        if (entry.inodeno == inodeno && entry.datano == datano)
+            entry.blockno = 0;
+    }
+};
+
+struct DataProxy
+{
+    int pos;
+    int inodeno;
+    DataProxy(int inodeno) : pos(0), inodeno(inodeno) {}
+
+    // What the direct, indirect and double indirect pointers reach
+    static inline constexpr size_t MAX_SIZE =
+        (1 + PointerBlock::POINTER_PER_BLOCK + size_t(PointerBlock::POINTER_PER_BLOCK) * PointerBlock::POINTER_PER_BLOCK) * BLOCK_SIZE;
+
+    static bool is_inline(size_t filesize)
+    {
+        return filesize <= INodeBlock::INLINE_SIZE;
+    }
+
+    int get_block_size();
+    // What a file grows by reads as zeros. The caller writes the last written
+    // bytes of the new size right after, the blocks wholly inside them are not
+    // cleared first
+    int resize(size_t size, size_t written = 0);
+    int resize_blocks(size_t size, size_t written = 0); // resize for files that are not inline before or after
+    int get_data_block(int datano);
+    int map_data_block(int datano);
+    size_t read(size_t offset, size_t length, void *data);
+    size_t load(size_t offset, size_t length, void *data); // read without touching atime
+    // How many of the next limit data blocks from datano sit right after blockno on the disk
+    int run(int datano, int blockno, int limit);
+    size_t write(size_t offset, size_t length, const void *data);
+    void readahead(int first, int count);
+};
+
+// Keeps inodes in memory so INodeProxy does not go through an INodeBlock on
+// every use. Open files stay pinned, and dirty inodes reach their blocks at
+// flush, one write per INodeBlock
+class INodeCache
+{
+    static inline constexpr int SETS = 1024, WAYS = 4;
+    // All inodes of one INodeBlock land in the same stripe, so its lock also
+    // covers the read-modify-write of that block
+    static inline constexpr int STRIPES = 16, SETS_PER_STRIPE = SETS / STRIPES;
+
+    struct Entry
+    {
+        bool valid;
+        bool dirty;
+        int inodeno;
+        int pins;
+        INodeBlock::INode inode;
+    };
+
+    inline static Entry entries[SETS][WAYS];
+    inline static uint8_t hands[SETS];
+    inline static Mutex locks[STRIPES];
+
+    static int stripe(int inodeno)
+    {
+        return inodeno / INodeBlock::INODE_IN_BLOCK % STRIPES;
+    }
+
+    static int set(int inodeno)
+    {
+        return stripe(inodeno) * SETS_PER_STRIPE + inodeno % SETS_PER_STRIPE;
+    }
+
+    static Entry *find(int inodeno)
+    {
+        for (auto &&entry : entries[set(inodeno)])
+            if (entry.valid && entry.inodeno == inodeno)
+                return &entry;
+        return nullptr;
+    }
+
+    // A free way for inodeno, evicting an unpinned one; nullptr if all are pinned
+    static Entry *take(int inodeno);
+
+    static bool load(int inodeno, INodeBlock::INode &inode);
+    static bool store(int inodeno, const INodeBlock::INode &inode);
+
+public:
+    // Both return true on a disk error, like a BlockProxy
+    static bool get(int inodeno, INodeBlock::INode &inode);
+    static bool put(int inodeno, const INodeBlock::INode &inode);
+    // get() for count inodes at once, reading each INodeBlock only once
+    static bool get_many(const int *inodenos, int count, INodeBlock::INode *inodes);
+
+    static void pin(int inodeno);
+    static void unpin(int inodeno);
+
+    static int flush();
+};
+
+// Reader/writer lock per inode: directories hold it around their entries and
+// files around their data. Only rename holds two, taken in inode order
+class INodeLocks
+{
+    inline static pthread_rwlock_t *locks = nullptr;
+
+public:
+    static void init(int count)
+    {
+        if (locks)
+            return;
+        pthread_rwlockattr_t attr;
+        pthread_rwlockattr_init(&attr);
+        // Keep a stream of readers from starving writers
+        pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+        locks = static_cast<pthread_rwlock_t *>(malloc(count * sizeof(pthread_rwlock_t)));
+        assert(locks);
+        for (int i = 0; i < count; i++)
+            pthread_rwlock_init(&locks[i], &attr);
+        pthread_rwlockattr_destroy(&attr);
+    }
+
+    static pthread_rwlock_t &of(int inodeno)
+    {
+        return locks[inodeno];
+    }
+};
+
+// What keeps an unlinked inode alive: open handles, and the lookups the
+// low-level frontend handed the kernel and it has not forgotten yet. The
+// inode is freed by whoever drops the last one; a crash before that leaves it
+// on the orphan list of the superblock for the next mount to free
+class INodeRefs
+{
+    struct Refs
+    {
+        uint64_t lookups;
+        int opens;
+        bool unlinked;
+    };
+    inline static Refs *refs = nullptr;
+    inline static int count = 0;
+    inline static Mutex lock;
+
+    // True once, when nothing refers to an unlinked inode any more
+    static bool idle(Refs &r)
+    {
+        if (!r.unlinked || r.lookups || r.opens)
+            return false;
+        r = {};
+        return true;
+    }
+
+public:
+    static void init(int inodes)
+    {
+        if (refs)
+            return;
+        refs = static_cast<Refs *>(calloc(inodes, sizeof(Refs)));
+        assert(refs);
+        count = inodes;
+    }
+
+    static void lookup(int inodeno)
+    {
+        MutexLock _(lock);
+        refs[inodeno].lookups++;
+    }
+
+    static void open(int inodeno)
+    {
+        MutexLock _(lock);
+        refs[inodeno].opens++;
+    }
+
+    // These return true when the caller is to free the inode
+    static bool forget(int inodeno, uint64_t lookups)
+    {
+        MutexLock _(lock);
+        auto &&r = refs[inodeno];
+        r.lookups -= std::min(lookups, r.lookups);
+        return idle(r);
+    }
+
+    static bool release(int inodeno)
+    {
+        MutexLock _(lock);
+        refs[inodeno].opens--;
+        return idle(refs[inodeno]);
+    }
+
+    static bool unlink(int inodeno)
+    {
+        MutexLock _(lock);
+        refs[inodeno].unlinked = true;
+        return idle(refs[inodeno]);
+    }
+
+    static bool unlinked(int inodeno)
+    {
+        MutexLock _(lock);
+        return refs[inodeno].unlinked;
+    }
+
+    // Takes an inode that is unlinked but still referred to, or -1; for an
+    // unmount, after which the kernel holds nothing
+    static int take_unlinked()
+    {
+        MutexLock _(lock);
+        for (int i = 0; i < count; i++)
+            if (refs[i].unlinked)
+            {
+                refs[i] = {};
+                return i;
+            }
+        return -1;
+    }
+};
+
+// Call counts, latency histograms and device blocks moved per operation, plus
+// a few event counters; /.fsstats serves them as text. Every thread records
+// into its own stripe with plain stores, so recording costs two clock reads
+// and no shared cache line; a snapshot sums all stripes. A stripe outlives its
+// thread and goes to the next new one, so counts are never lost. Latencies go
+// in HDR style buckets, eight per power of two, about 12% wide.
+class Stats
+{
+public:
+    enum Op
+    {
+        // The FUSE callbacks
+        GETATTR,
+        FGETATTR,
+        LOOKUP,
+        SETATTR,
+        MKNOD,
+        MKDIR,
+        CREATE,
+        UNLINK,
+        RMDIR,
+        RENAME,
+        TRUNCATE,
+        FTRUNCATE,
+        UTIME,
+        OPEN,
+        OPENDIR,
+        READ,
+        WRITE,
+        FLUSH,
+        RELEASE,
+        RELEASEDIR,
+        READDIR,
+        FSYNC,
+        STATFS,
+        // What they do underneath
+        BLOCK_READ,  // Disk::read, through the block cache
+        BLOCK_WRITE, // Disk::write
+        RUN_READ,    // Disk::read_run
+        RUN_WRITE,   // Disk::write_run
+        DEVICE_READ, // disk_read(v), the blocks of each count as read
+        DEVICE_WRITE,
+        DEVICE_SYNC,
+        ALLOC_INODE,
+        ALLOC_DATA,
+        OPS
+    };
+
+    enum Counter
+    {
+        CACHE_HITS, // blocks found in the block cache by reads
+        CACHE_MISSES,
+        DATA_BLOCKS_ALLOCATED,
+        COUNTERS
+    };
+
+private:
+    static inline constexpr const char *OP_NAMES[] = {
+        "getattr", "fgetattr", "lookup", "setattr", "mknod", "mkdir", "create", "unlink",
+        "rmdir", "rename", "truncate", "ftruncate", "utime", "open", "opendir", "read",
+        "write", "flush", "release", "releasedir", "readdir", "fsync", "statfs", "block_read",
+        "block_write", "run_read", "run_write", "device_read", "device_write", "device_sync", "alloc_inode", "alloc_data"};
+    static inline constexpr const char *COUNTER_NAMES[] = {"cache_hits", "cache_misses", "data_blocks_allocated"};
+    static_assert(sizeof(OP_NAMES) / sizeof(OP_NAMES[0]) == OPS);
+    static_assert(sizeof(COUNTER_NAMES) / sizeof(COUNTER_NAMES[0]) == COUNTERS);
+
+    // Latencies from 2^LIMIT_BITS ns, over an hour, share the last bucket
+    static inline constexpr int SUB_BITS = 3, SUB_BUCKETS = 1 << SUB_BITS, LIMIT_BITS = 42;
+    static inline constexpr int BUCKETS = (LIMIT_BITS - SUB_BITS + 1) * SUB_BUCKETS;
+
+    struct OpStats
+    {
+        uint64_t calls; // the sum of the buckets, only in snapshots
+        uint64_t nanoseconds, max, blocks_read, blocks_written;
+        uint64_t buckets[BUCKETS];
+    };
+
+    struct Stripe
+    {
+        OpStats ops[OPS];
+        uint64_t counters[COUNTERS];
+        Stripe *next;      // in the list of all stripes
+        Stripe *next_idle; // in the list of those without a thread
+    };
+
+    inline static Stripe *stripes = nullptr; // atomic, only ever grows
+    inline static Stripe *idle = nullptr;    // under lock
+    inline static Mutex lock;
+    inline static pthread_key_t key;
+    inline static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+    inline static thread_local Stripe *mine = nullptr;
+    // Device blocks this thread moved so far, a Scope takes the difference
+    inline static thread_local uint64_t blocks_read = 0, blocks_written = 0;
+
+    static void retire(void *stripe)
+    {
+        MutexLock _(lock);
+        auto now = static_cast<Stripe *>(stripe);
+        now->next_idle = idle;
+        idle = now;
+    }
+
+    static void create_key()
+    {
+        pthread_key_create(&key, retire);
+    }
+
+    static Stripe &local()
+    {
+        if (__builtin_expect(mine != nullptr, 1))
+            return *mine;
+        pthread_once(&key_once, create_key);
+        {
+            MutexLock _(lock);
+            if (idle)
+            {
+                mine = idle;
+                idle = idle->next_idle;
+            }
+            else
+            {
+                mine = static_cast<Stripe *>(calloc(1, sizeof(Stripe)));
+                assert(mine);
+                mine->next = stripes;
+                __atomic_store_n(&stripes, mine, __ATOMIC_RELEASE);
+            }
+        }
+        pthread_setspecific(key, mine);
+        return *mine;
+    }
+
+    // Only the owning thread writes a stripe, snapshots read it concurrently
+    static void bump(uint64_t &counter, uint64_t by)
+    {
+        __atomic_store_n(&counter, counter + by, __ATOMIC_RELAXED);
+    }
+
+    static int bucket(uint64_t nanoseconds)
+    {
+        nanoseconds = std::min(nanoseconds, (uint64_t(1) << LIMIT_BITS) - 1);
+        if (nanoseconds < 2 * SUB_BUCKETS)
+            return nanoseconds;
+        int shift = 63 - __builtin_clzll(nanoseconds) - SUB_BITS;
+        return shift * SUB_BUCKETS + (nanoseconds >> shift);
+    }
+
+    // The largest latency that lands in bucket i
+    static uint64_t bucket_top(int i)
+    {
+        if (i < 2 * SUB_BUCKETS)
+            return i;
+        int shift = i / SUB_BUCKETS - 1;
+        return (uint64_t(i % SUB_BUCKETS + SUB_BUCKETS + 1) << shift) - 1;
+    }
+
+    static uint64_t percentile(const OpStats &op, int percent)
+    {
+        uint64_t rank = (op.calls * percent + 99) / 100, seen = 0;
+        for (int i = 0; i < BUCKETS; i++)
+            if ((seen += op.buckets[i]) >= rank)
+                return std::min(bucket_top(i), op.max);
+        return op.max;
+    }
+
+    static uint64_t now()
+    {
+        timespec time;
+        clock_gettime(CLOCK_MONOTONIC, &time);
+        return uint64_t(time.tv_sec) * 1000000000 + time.tv_nsec;
+    }
+
+public:
+    // Times one operation, and counts the device blocks its thread moves meanwhile
+    class Scope
+    {
+        Op op;
+        uint64_t start, read, written;
+
+    public:
+        Scope(Op op) : op(op), start(now()), read(blocks_read), written(blocks_written) {}
+        Scope(const Scope &) = delete;
+
+        ~Scope()
+        {
+            uint64_t nanoseconds = now() - start;
+            auto &&stats = local().ops[op];
+            bump(stats.nanoseconds, nanoseconds);
+            bump(stats.blocks_read, blocks_read - read);
+            bump(stats.blocks_written, blocks_written - written);
+            bump(stats.buckets[bucket(nanoseconds)], 1);
+            if (nanoseconds > stats.max)
+                __atomic_store_n(&stats.max, nanoseconds, __ATOMIC_RELAXED);
+        }
+    };
+
+    static void count(Counter counter, uint64_t by = 1)
+    {
+        bump(local().counters[counter], by);
+    }
+
+    static void transferred(uint64_t read, uint64_t written)
+    {
+        blocks_read += read;
+        blocks_written += written;
+    }
+
+    // Device blocks read and written so far, by all threads
+    static void transfers(uint64_t &read, uint64_t &written)
+    {
+        read = written = 0;
+        for (auto stripe = __atomic_load_n(&stripes, __ATOMIC_ACQUIRE); stripe; stripe = stripe->next)
+        {
+            read += __atomic_load_n(&stripe->ops[DEVICE_READ].blocks_read, __ATOMIC_RELAXED);
+            written += __atomic_load_n(&stripe->ops[DEVICE_WRITE].blocks_written, __ATOMIC_RELAXED);
+        }
+    }
+
+    // Appends the sums over all stripes, one line per operation seen
+    static void snapshot(std::vector<char, malloc_allocator<char>> &text)
+    {
+        char line[160];
+        auto print = [&](int length) { text.insert(text.end(), line, line + std::min<int>(length, sizeof(line) - 1)); };
+        print(snprintf(line, sizeof(line), "%-12s %10s %10s %10s %10s %10s %9s %9s\n", "op", "calls", "avg_us", "p50_us",
+                       "p99_us", "max_us", "reads/op", "writes/op"));
+        auto first = __atomic_load_n(&stripes, __ATOMIC_ACQUIRE);
+        for (int op = 0; op < OPS; op++)
+        {
+            OpStats sum = {};
+            for (auto stripe = first; stripe; stripe = stripe->next)
+            {
+                auto &&now = stripe->ops[op];
+                sum.nanoseconds += __atomic_load_n(&now.nanoseconds, __ATOMIC_RELAXED);
+                sum.max = std::max(sum.max, __atomic_load_n(&now.max, __ATOMIC_RELAXED));
+                sum.blocks_read += __atomic_load_n(&now.blocks_read, __ATOMIC_RELAXED);
+                sum.blocks_written += __atomic_load_n(&now.blocks_written, __ATOMIC_RELAXED);
+                for (int i = 0; i < BUCKETS; i++)
+                    sum.buckets[i] += __atomic_load_n(&now.buckets[i], __ATOMIC_RELAXED);
+            }
+            sum.calls = std::accumulate(sum.buckets, sum.buckets + BUCKETS, uint64_t(0));
+            if (sum.calls == 0)
+                continue;
+            print(snprintf(line, sizeof(line), "%-12s %10llu %10.1f %10.1f %10.1f %10.1f %9.2f %9.2f\n", OP_NAMES[op],
+                           (unsigned long long)sum.calls, sum.nanoseconds / 1e3 / sum.calls, percentile(sum, 50) / 1e3,
+                           percentile(sum, 99) / 1e3, sum.max / 1e3, double(sum.blocks_read) / sum.calls,
+                           double(sum.blocks_written) / sum.calls));
+        }
+        for (int counter = 0; counter < COUNTERS; counter++)
+        {
+            uint64_t sum = 0;
+            for (auto stripe = first; stripe; stripe = stripe->next)
+                sum += __atomic_load_n(&stripe->counters[counter], __ATOMIC_RELAXED);
+            print(snprintf(line, sizeof(line), "%-22s %10llu\n", COUNTER_NAMES[counter], (unsigned long long)sum));
+        }
+    }
+};
+
+class Disk
+{
+    static inline constexpr int CACHE_SHARDS = std::clamp(CACHE_BLOCKS / 256, 1, 16);
+    static inline constexpr int CACHE_INITIAL_SIZE = 64;
+    static inline constexpr int CACHE_MAX_SIZE = CACHE_BLOCKS / CACHE_SHARDS;                   // per shard
+    static inline constexpr int CACHE_HASH_SIZE = 1 << (32 - __builtin_clz(CACHE_MAX_SIZE)); // >= 2 * max size
+
+    // Eviction is GreedyDual: a block's priority is the cache clock at its last
+    // access plus the bias of its type, and the clock advances to the priority
+    // of every victim. Streaming data (bias 0) therefore only ages other data,
+    // while metadata has to go unused for a whole bias worth of evictions.
+    static inline constexpr int CACHE_BIASES[] = {DataBlock::bias, INodeBlock::bias, BitmapBlock::bias, HeaderBlock::bias};
+    static inline constexpr int CACHE_LEVELS = sizeof(CACHE_BIASES) / sizeof(CACHE_BIASES[0]);
+    static inline constexpr int CACHE_FREE = CACHE_LEVELS;       // list of unused slots
+    static inline constexpr int CACHE_PINNED = CACHE_LEVELS + 1; // list of dirty slots, never evicted
+    static_assert(PointerBlock::bias == INodeBlock::bias);
+
+    static constexpr int cache_level(int bias)
+    {
+        for (int level = 0; level < CACHE_LEVELS; level++)
+            if (CACHE_BIASES[level] == bias)
+                return level;
+        return -1;
+    }
+
+    // A dirty block holds changes no commit has logged yet; it stays pinned, as
+    // the disk must not see them before their transaction is in the journal.
+    // A pending block was logged by a commit but not written in place yet.
+    struct CacheBlock
+    {
+        int blockno;
+        uint64_t timestamp;
+        bool dirty, pending;
+        int level;              // which list the slot is in
+        int home;               // level to return to when a dirty slot gets committed
+        int hash_next;          // next slot in the same bucket
+        int lru_prev, lru_next; // slot list, most recently used first
+        alignas(64) char data[BLOCK_SIZE];
+        CacheBlock()
+            : blockno(-1), timestamp(0), dirty(false), pending(false), level(CACHE_FREE), home(CACHE_FREE), hash_next(-1),
+              lru_prev(-1), lru_next(-1) {}
+    };
+
+    // The cache is split into shards by block number, each with its own lock,
+    // slots and eviction clock, so threads touching different blocks rarely meet
+    struct CacheShard
+    {
+        Mutex lock;
+
+        // Slots never move once allocated, so everything links by slot index.
+        // Every level has its own lru list; timestamps within a list are monotonic,
+        // so the lowest priority block of a level is always at the tail.
+        CacheBlock *cache = nullptr;
+        int cache_size = 0;
+        uint64_t cache_clock = 0;
+        int cache_lru_head[CACHE_LEVELS + 2];
+        int cache_lru_tail[CACHE_LEVELS + 2];
+        int cache_buckets[CACHE_HASH_SIZE];
+
+        int cache_hash(int blockno)
+        {
+            return (uint32_t(blockno) * 2654435761u) & (CACHE_HASH_SIZE - 1);
+        }
+
+        void cache_unlink(int slot)
+        {
+            auto &&now = cache[slot];
+            if (now.lru_prev != -1)
+                cache[now.lru_prev].lru_next = now.lru_next;
+            else
+                cache_lru_head[now.level] = now.lru_next;
+            if (now.lru_next != -1)
+                cache[now.lru_next].lru_prev = now.lru_prev;
+            else
+                cache_lru_tail[now.level] = now.lru_prev;
+            now.lru_prev = now.lru_next = -1;
+        }
+
+        void cache_push_front(int slot, int level)
+        {
+            auto &&now = cache[slot];
+            now.level = level;
+            now.lru_prev = -1;
+            now.lru_next = cache_lru_head[level];
+            if (cache_lru_head[level] != -1)
+                cache[cache_lru_head[level]].lru_prev = slot;
+            else
+                cache_lru_tail[level] = slot;
+            cache_lru_head[level] = slot;
+        }
+
+        // Past CACHE_MAX_SIZE only when every slot is pinned
+        void cache_grow(bool overflow = false)
+        {
+            int new_size = overflow ? cache_size * 2
+                           : cache_size ? std::min(cache_size * 2, CACHE_MAX_SIZE)
+                                        : std::min(CACHE_INITIAL_SIZE, CACHE_MAX_SIZE);
+            auto new_cache = static_cast<CacheBlock *>(realloc(cache, new_size * sizeof(CacheBlock)));
+            assert(new_cache);
+            if (cache == nullptr)
+            {
+                std::fill(cache_buckets, cache_buckets + CACHE_HASH_SIZE, -1);
+                std::fill(cache_lru_head, cache_lru_head + CACHE_LEVELS + 2, -1);
+                std::fill(cache_lru_tail, cache_lru_tail + CACHE_LEVELS + 2, -1);
+            }
+            cache = new_cache;
+            for (int slot = cache_size; slot < new_size; slot++)
+            {
+                new (&cache[slot]) CacheBlock;
+                cache_push_front(slot, CACHE_FREE);
+            }
+            Info << Show(cache_size) << Show(new_size);
+            cache_size = new_size;
+        }
+
+        int cache_lookup(int blockno)
+        {
+            if (cache == nullptr)
+                return -1;
+            for (int slot = cache_buckets[cache_hash(blockno)]; slot != -1; slot = cache[slot].hash_next)
+                if (cache[slot].blockno == blockno)
+                    return slot;
+            return -1;
+        }
+
+        void cache_remove(int slot)
+        {
+            auto &&now = cache[slot];
+            if (now.blockno == -1)
+                return;
+            for (int *pos = &cache_buckets[cache_hash(now.blockno)]; *pos != -1; pos = &cache[*pos].hash_next)
+            {
+                if (*pos == slot)
+                {
+                    *pos = now.hash_next;
+                    break;
+                }
+            }
+            now.blockno = -1;
+            now.hash_next = -1;
+        }
+
+        void cache_release(int slot)
+        {
+            cache_remove(slot);
+            cache_unlink(slot);
+            cache_push_front(slot, CACHE_FREE);
+        }
+
+        // Writes a pending block in place, its transaction is already safe
+        int cache_writeback(int slot)
+        {
+            auto &&now = cache[slot];
+            assert(!now.dirty);
+            if (!now.pending)
+                return 0;
+            int err = device_write(now.blockno, now.data);
+            if (err)
+                Error << Show(now.blockno) << Show(err);
+            else
+                now.pending = false;
+            return err;
+        }
+
+        // Call before changing the contents of a slot, which must stay as they
+        // are when it fails
+        int cache_dirty(int slot)
+        {
+            auto &&now = cache[slot];
+            if (now.dirty)
+                return 0;
+            if (int err = cache_writeback(slot)) // the committed image leaves the cache now
+                return err;
+            now.dirty = true;
+            now.home = now.level;
+            cache_unlink(slot);
+            cache_push_front(slot, CACHE_PINNED);
+            __atomic_add_fetch(&dirty_blocks, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+
+        // A commit logged the slot
+        void cache_committed(int slot)
+        {
+            auto &&now = cache[slot];
+            now.dirty = false;
+            now.pending = true;
+            now.timestamp = cache_clock;
+            cache_unlink(slot);
+            cache_push_front(slot, now.home);
+            __atomic_sub_fetch(&dirty_blocks, 1, __ATOMIC_RELAXED);
+        }
+
+        int cache_victim()
+        {
+            int victim = -1;
+            uint64_t victim_priority = UINT64_MAX;
+            for (int level = 0; level < CACHE_LEVELS; level++)
+            {
+                int slot = cache_lru_tail[level];
+                if (slot == -1)
+                    continue;
+                uint64_t priority = cache[slot].timestamp + CACHE_BIASES[level];
+                if (priority < victim_priority)
+                {
+                    victim = slot;
+                    victim_priority = priority;
+                }
+            }
+            if (victim != -1)
+                cache_clock = std::max(cache_clock, victim_priority);
+            return victim;
+        }
+
+        // Returns a slot bound to blockno, most recently used first, contents
+        // undefined. -1 when the victim could not be written back: it stays
+        // cached and pending, as after the next checkpoint no other copy is left
+        int cache_take(int blockno, int level)
+        {
+            if (cache == nullptr || (cache_lru_tail[CACHE_FREE] == -1 && cache_size < CACHE_MAX_SIZE))
+                cache_grow();
+
+            int slot = cache_lru_tail[CACHE_FREE];
+            if (slot == -1 && (slot = cache_victim()) == -1)
+            {
+                cache_grow(true);
+                slot = cache_lru_tail[CACHE_FREE];
+            }
+            else if (cache[slot].blockno != -1)
+            {
+                Debug << "Evict" << Show(cache[slot].blockno) << Show(cache[slot].level) << Show(cache[slot].pending);
+                if (cache_writeback(slot))
+                {
+                    cache_touch(slot, cache[slot].level); // the next miss tries another
+                    return -1;
+                }
+                cache_remove(slot);
+            }
+
+            auto &&now = cache[slot];
+            now.blockno = blockno;
+            now.dirty = now.pending = false;
+            now.timestamp = cache_clock;
+            int bucket = cache_hash(blockno);
+            now.hash_next = cache_buckets[bucket];
+            cache_buckets[bucket] = slot;
+
+            cache_unlink(slot);
+            cache_push_front(slot, level);
+            return slot;
+        }
+
+        void cache_touch(int slot, int level)
+        {
+            cache[slot].timestamp = cache_clock;
+            if (cache[slot].dirty)
+            {
+                cache[slot].home = level;
+                return;
+            }
+            if (cache_lru_head[level] == slot)
+                return;
+            cache_unlink(slot);
+            cache_push_front(slot, level);
+        }
+    };
+
+    static CacheShard cache_shards[CACHE_SHARDS]; // defined after the class, CacheShard needs it complete
+
+    static CacheShard &cache_shard(int blockno)
+    {
+        return cache_shards[blockno % CACHE_SHARDS];
+    }
+
+    // Every transfer to and from the disk goes through these, for the stats
+    static int device_read(int blockno, void *buffer)
+    {
+        Stats::Scope _(Stats::DEVICE_READ);
+        Stats::transferred(1, 0);
+        return disk_read(blockno, buffer);
+    }
+
+    static int device_readv(int blockno, const iovec *iov, int count)
+    {
+        Stats::Scope _(Stats::DEVICE_READ);
+        Stats::transferred(count, 0);
+        return disk_readv(blockno, iov, count);
+    }
+
+    static int device_write(int blockno, void *buffer)
+    {
+        Stats::Scope _(Stats::DEVICE_WRITE);
+        Stats::transferred(0, 1);
+        return disk_write(blockno, buffer);
+    }
+
+    static int device_writev(int blockno, const iovec *iov, int count)
+    {
+        Stats::Scope _(Stats::DEVICE_WRITE);
+        Stats::transferred(0, count);
+        return disk_writev(blockno, iov, count);
+    }
+
+    static int device_sync()
+    {
+        Stats::Scope _(Stats::DEVICE_SYNC);
+        return disk_sync();
+    }
+
+    template <int bias>
+    static int __read(int blockno, void *buffer)
+    {
+        static_assert(cache_level(bias) != -1);
+        Stats::Scope stats(Stats::BLOCK_READ);
+        if (blockno >= block_num || blockno < 0)
+            return 1;
+
+        auto &&shard = cache_shard(blockno);
+        MutexLock _(shard.lock);
+        int slot = shard.cache_lookup(blockno);
+        if (slot != -1)
+        {
+            Stats::count(Stats::CACHE_HITS);
+            shard.cache_touch(slot, cache_level(bias));
+        }
+        else
+        {
+            Stats::count(Stats::CACHE_MISSES);
+            if ((slot = shard.cache_take(blockno, cache_level(bias))) == -1)
+                return 1;
+            if (int err = device_read(blockno, shard.cache[slot].data))
+            {
+                shard.cache_release(slot);
+                return err;
+            }
+        }
+        memcpy(buffer, shard.cache[slot].data, BLOCK_SIZE);
+        return 0;
+    }
+
+    template <int bias>
+    static int __write(int blockno, void *buffer)
+    {
+        static_assert(cache_level(bias) != -1);
+        Stats::Scope stats(Stats::BLOCK_WRITE);
+        if (blockno >= block_num || blockno < 0)
+            return 1;
+
+        auto &&shard = cache_shard(blockno);
+        MutexLock _(shard.lock);
+        int slot = shard.cache_lookup(blockno);
+        if (slot != -1)
+            shard.cache_touch(slot, cache_level(bias));
+        else if ((slot = shard.cache_take(blockno, cache_level(bias))) == -1) // whole block is overwritten, no need to read it first
+            return 1;
+        if (int err = shard.cache_dirty(slot))
+            return err;
+        memcpy(shard.cache[slot].data, buffer, BLOCK_SIZE);
+        return 0;
+    }
+
+    // Guards the bitmaps, their summaries and hints, and the superblock counters
+    inline static Mutex alloc_lock;
+    inline static int data_bitmap_min_pos = 0, inode_bitmap_min_pos = 0;
+    inline static FreeSummary inode_summary, data_summary;
+
+    // The superblock stays resident from mount on; its free counters reach
+    // block 0 only when flush finds it dirty
+    inline static HeaderBlock superblock;
+    inline static bool superblock_dirty = false;
+
+    static int write_header(bool only_dirty = false)
+    {
+        MutexLock _(alloc_lock);
+        if (only_dirty && !superblock_dirty)
+            return 0;
+        auto block = from_blockno<HeaderBlock>(0);
+        *block = superblock;
+        block.commit();
+        superblock_dirty = false;
+        return block;
+    }
+
+    static void summarize()
+    {
+        commit_threshold = std::max(1, std::min<int>(COMMIT_THRESHOLD, superblock.journal_blocks / 2));
+        INodeLocks::init(superblock.inode_num_tot);
+        INodeRefs::init(superblock.inode_num_tot);
+        inode_summary.build(superblock.inode_bitmap_offset, superblock.data_block_bitmap_offset);
+        data_summary.build(superblock.data_block_bitmap_offset, superblock.group_offset);
+    }
+
+    // Every block written through the cache reaches the disk by way of the
+    // journal. Operations hold txn_lock shared from start to end and a commit
+    // takes it exclusive, so a transaction only ever holds whole operations,
+    // those of everyone who asked for a commit while the last one ran included.
+    // The rest of the journal state is guarded by commit_lock.
+    inline static Mutex commit_lock;
+    inline static pthread_rwlock_t txn_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+    inline static uint64_t sealed = 0, committed = 0; // groups of operations, atomic
+    inline static int commit_error = 0;
+    inline static uint32_t journal_sequence = 1; // of the next transaction
+    inline static int journal_head = 1;          // where it goes, in blocks into the region
+    inline static int dirty_blocks = 0;          // atomic
+    // Blocks logged since the journal was last emptied, under all shard locks
+    // to change and under the block's shard lock to read; sized with the disk
+    inline static std::vector<uint64_t, malloc_allocator<uint64_t>> journal_live;
+    // Dirty blocks that make a commit due, at most half the journal so that a
+    // transaction fits it with room for the operations still running
+    static inline constexpr int COMMIT_THRESHOLD = CACHE_BLOCKS / 2;
+    inline static int commit_threshold = COMMIT_THRESHOLD;
+
+    static bool logged(int blockno)
+    {
+        return journal_live[blockno / 64] >> blockno % 64 & 1;
+    }
+
+    using Slots = std::vector<std::pair<int, CacheShard *>, malloc_allocator<std::pair<int, CacheShard *>>>;
+
+    // Writes the blocks in place, adjacent ones with one disk_writev; sorts them
+    static int write_in_place(Slots &slots)
+    {
+        std::sort(slots.begin(), slots.end(), [](auto &&a, auto &&b) {
+            return a.second->cache[a.first].blockno < b.second->cache[b.first].blockno;
+        });
+        int err = 0;
+        std::vector<iovec, malloc_allocator<iovec>> iov;
+        for (size_t i = 0, j; i < slots.size(); i = j)
+        {
+            int first = slots[i].second->cache[slots[i].first].blockno;
+            iov.clear();
+            for (j = i; j < slots.size() && slots[j].second->cache[slots[j].first].blockno == first + int(j - i); j++)
+                iov.push_back({slots[j].second->cache[slots[j].first].data, BLOCK_SIZE});
+            if (int _ = device_writev(first, iov.data(), iov.size()))
+            {
+                Error << Show(first) << Show(iov.size()) << Show(_);
+                err = _;
+            }
+        }
+        return err;
+    }
+
+    static int write_journal_header()
+    {
+        JournalRecord header = {JournalRecord::HEADER, journal_sequence, {1}};
+        return device_write(superblock.journal_offset, &header);
+    }
+
+    // Writes every pending block in place and empties the journal; the caller
+    // holds all shard locks
+    static int checkpoint()
+    {
+        Slots pending;
+        for (auto &&shard : cache_shards)
+            for (int slot = 0; slot < shard.cache_size; slot++)
+                if (shard.cache[slot].blockno != -1 && shard.cache[slot].pending)
+                    pending.push_back({slot, &shard});
+        int err = write_in_place(pending) || device_sync() || write_journal_header() || device_sync();
+        Info << Show(pending.size()) << Show(err);
+        if (err)
+            return EIO;
+        for (auto &&[slot, shard] : pending)
+            shard->cache[slot].pending = false;
+        std::fill(journal_live.begin(), journal_live.end(), 0);
+        journal_head = 1;
+        return 0;
+    }
+
+    // Logs count dirty blocks as one transaction: descriptors and images, a
+    // sync, the commit record, a sync
+    static int journal_log(const std::pair<int, CacheShard *> *dirty, int count)
+    {
+        int descriptors = (count + JournalRecord::BLOCKS_PER_TRANSACTION - 1) / JournalRecord::BLOCKS_PER_TRANSACTION;
+        std::vector<JournalRecord, malloc_allocator<JournalRecord>> records(descriptors + 1);
+        std::vector<iovec, malloc_allocator<iovec>> iov;
+        uint64_t state = journal_sequence;
+        for (int i = 0; i < count;)
+        {
+            auto &&descriptor = records[i / JournalRecord::BLOCKS_PER_TRANSACTION];
+            descriptor.magic = JournalRecord::DESCRIPTOR;
+            descriptor.sequence = journal_sequence;
+            descriptor.count = std::min(count - i, JournalRecord::BLOCKS_PER_TRANSACTION);
+            iov.push_back({&descriptor, BLOCK_SIZE});
+            for (int j = 0; j < int(descriptor.count); j++, i++)
+            {
+                auto &&block = dirty[i].second->cache[dirty[i].first];
+                descriptor.blocknos[j] = block.blockno;
+                iov.push_back({block.data, BLOCK_SIZE});
+            }
+            state = JournalRecord::hash(state, &iov[iov.size() - descriptor.count], descriptor.count);
+        }
+        auto &&commit = records[descriptors];
+        commit.magic = JournalRecord::COMMIT;
+        commit.sequence = journal_sequence;
+        commit.checksum = JournalRecord::fold(state);
+
+        int at = superblock.journal_offset + journal_head;
+        if (device_writev(at, iov.data(), iov.size()) || device_sync() || device_write(at + iov.size(), &commit) || device_sync())
+        {
+            Error << Show(journal_sequence) << Show(count);
+            return EIO;
+        }
+        for (int i = 0; i < count; i++)
+        {
+            auto &&[slot, shard] = dirty[i];
+            int blockno = shard->cache[slot].blockno;
+            journal_live[blockno / 64] |= uint64_t(1) << blockno % 64;
+            shard->cache_committed(slot);
+        }
+        Debug << Show(journal_sequence) << Show(journal_head) << Show(count);
+        journal_head += JournalRecord::blocks(count);
+        journal_sequence++;
+        return 0;
+    }
 
-struct DataProxy
-{
-    int pos;
-    int inodeno;
-    DataProxy(int inodeno) : pos(0), inodeno(inodeno) {}
+    // Logs every dirty block as one transaction. One that can't fit even an
+    // empty journal, an operation larger than the journal, is logged as
+    // several: each of them is still replayed whole or not at all, though the
+    // operation that spans them no longer is. The caller holds all shard locks
+    static int journal_commit()
+    {
+        Slots dirty;
+        for (auto &&shard : cache_shards)
+            if (shard.cache) // the lists of a shard are set up with its first slot
+                for (int slot = shard.cache_lru_head[CACHE_PINNED]; slot != -1; slot = shard.cache[slot].lru_next)
+                    dirty.push_back({slot, &shard});
+        int room = superblock.journal_blocks - 1, fit = room;
+        while (fit > 0 && JournalRecord::blocks(fit) > room)
+            fit--;
+        if (int(dirty.size()) > fit)
+        {
+            Error << "Transaction too large for the journal, splitting it" << Show(dirty.size()) << Show(fit);
+        }
 
-    int get_block_size();
-    int resize(size_t size);
-    int get_data_block(int datano);
-    size_t read(size_t offset, size_t length, void *data);
-    size_t write(size_t offset, size_t length, const void *data);
-};
+        for (int done = 0, count; done < int(dirty.size()); done += count)
+        {
+            count = std::min(int(dirty.size()) - done, fit);
+            if (journal_head + JournalRecord::blocks(count) > int(superblock.journal_blocks))
+                if (int err = checkpoint())
+                    return err;
+            if (int err = journal_log(dirty.data() + done, count))
+                return err;
+        }
+        return 0;
+    }
 
-class Disk
-{
-    static inline constexpr int CACHE_INITIAL_SIZE = 64;
-    struct CacheBlock
+    // Writes back in place what the journal committed before a crash, then
+    // empties it. Runs before anything is read through the cache. The log ends
+    // at the first record that does not check out; a block that can't be read
+    // is an error instead, what follows it may well be committed
+    static int replay(const HeaderBlock &layout)
     {
-        int blockno;
-        uint32_t timestamp;
-        char data[BLOCK_SIZE];
-        CacheBlock() : blockno(-1), timestamp(0x3FFFFFFF) {}
-    };
+        int limit = layout.journal_blocks;
+        auto records = static_cast<JournalRecord *>(malloc(sizeof(JournalRecord) * (JournalRecord::BLOCKS_PER_TRANSACTION + 2)));
+        if (records == nullptr)
+            return ENOMEM;
+        Defer _([&] { free(records); });
+        auto &&descriptor = records[0];
+        if (device_read(layout.journal_offset, &descriptor))
+            return EIO;
+        if (descriptor.magic != JournalRecord::HEADER || descriptor.start < 1 || descriptor.start >= limit)
+            return EINVAL; // mkfs writes it before anything else
+        uint32_t sequence = descriptor.sequence;
+        int head = descriptor.start, replayed = 0;
+
+        std::vector<iovec, malloc_allocator<iovec>> iov;
+        // Reads the descriptor at at and the images it lists, false if it is
+        // not one of this transaction
+        auto load = [&](int at, int &err) {
+            if (at + 2 > limit)
+                return false;
+            if ((err = device_read(layout.journal_offset + at, &descriptor) ? EIO : 0))
+                return false;
+            if (descriptor.magic != JournalRecord::DESCRIPTOR || descriptor.sequence != sequence || descriptor.count < 1 ||
+                descriptor.count > JournalRecord::BLOCKS_PER_TRANSACTION || at + int(descriptor.count) + 2 > limit)
+                return false;
+            iov.clear();
+            for (int i = 0; i < int(descriptor.count); i++)
+                iov.push_back({&records[i + 1], BLOCK_SIZE});
+            err = device_readv(layout.journal_offset + at + 1, iov.data(), descriptor.count) ? EIO : 0;
+            return !err;
+        };
+        auto &&commit = records[JournalRecord::BLOCKS_PER_TRANSACTION + 1];
+        for (;;)
+        {
+            // Checks the whole transaction first, then writes it back
+            int end = head, err = 0;
+            uint64_t state = sequence;
+            while (load(end, err))
+            {
+                state = JournalRecord::hash(state, iov.data(), descriptor.count);
+                end += descriptor.count + 1;
+            }
+            if (err)
+                return err;
+            if (end == head)
+                break;
+            if (device_read(layout.journal_offset + end, &commit))
+                return EIO;
+            if (commit.magic != JournalRecord::COMMIT || commit.sequence != sequence || commit.checksum != JournalRecord::fold(state))
+                break;
+            for (int now = head; now < end; now += descriptor.count + 1)
+            {
+                if (!load(now, err))
+                    return err ? err : EIO;
+                for (int i = 0; i < int(descriptor.count); i++)
+                    if (descriptor.blocknos[i] >= layout.block_num || device_write(descriptor.blocknos[i], &records[i + 1]))
+                        return EIO;
+            }
+            sequence++;
+            head = end + 1;
+            replayed++;
+        }
+        Info << Show(replayed) << Show(sequence);
 
-    template <int bias>
-    static int __read(int blockno, void *buffer)
-    {
-        return disk_read(blockno, buffer);
+        journal_sequence = sequence;
+        journal_head = replayed ? 1 : head;
+        if (replayed)
+        {
+            superblock.journal_offset = layout.journal_offset;
+            if (device_sync() || write_journal_header() || device_sync())
+                return EIO;
+        }
+        return 0;
     }
 
-    template <int bias>
-    static int __write(int blockno, void *buffer)
+    // Set when the backend maps the whole disk. Every write still goes through
+    // the cache and the journal, the mapping only spares copies of file and
+    // directory contents that nothing has changed since the last checkpoint.
+    inline static char *map_base = nullptr;
+    inline static int block_num = 0; // of the device
+
+    static void attach()
     {
-        return disk_write(blockno, buffer);
+        static bool attached = false;
+        if (attached)
+            return;
+        attached = true;
+        map_base = static_cast<char *>(disk_map());
+        block_num = disk_blocks();
+        journal_live.assign((block_num + 63) / 64, 0);
+        atexit(&__flush);
     }
 
-    inline static int data_bitmap_min_pos = 0, inode_bitmap_min_pos = 0;
+    // Gives the device the size of the filesystem on it, or about to be made
+    static int resize(int blocks)
+    {
+        if (blocks == block_num)
+            return 0;
+        if (disk_resize(blocks))
+            return 1;
+        map_base = static_cast<char *>(disk_map());
+        block_num = blocks;
+        journal_live.assign((block_num + 63) / 64, 0);
+        return 0;
+    }
 
 public:
+    // The superblock mount last found on the disk, to explain a refusal
+    inline static HeaderBlock formatted;
+
+    static char *mapped()
+    {
+        return map_base;
+    }
+
+    static int blocks()
+    {
+        return block_num;
+    }
+
+    // Whether the cache holds a block, so that the disk may be behind it
+    static bool cached(int blockno)
+    {
+        auto &&shard = cache_shard(blockno);
+        MutexLock _(shard.lock);
+        return shard.cache_lookup(blockno) != -1;
+    }
+
+    // Commits every finished operation, dirty inodes and superblock counters
+    // included, as one transaction and syncs the disk. Callers that arrive
+    // while a commit runs share the next one.
+    static int flush()
+    {
+        uint64_t group = __atomic_load_n(&sealed, __ATOMIC_ACQUIRE) + 1;
+        MutexLock _(commit_lock);
+        if (__atomic_load_n(&committed, __ATOMIC_ACQUIRE) >= group)
+            return commit_error;
+
+        int err;
+        {
+            WriteLock _(txn_lock);
+            group = __atomic_add_fetch(&sealed, 1, __ATOMIC_ACQ_REL);
+            err = INodeCache::flush();
+            if (int _ = write_header(true))
+                err = _;
+            for (auto &&shard : cache_shards)
+                pthread_mutex_lock(&shard.lock.native);
+            if (int _ = journal_commit())
+                err = _;
+            for (auto &&shard : cache_shards)
+                pthread_mutex_unlock(&shard.lock.native);
+        }
+        if (int _ = device_sync())
+            err = _;
+        Debug << Show(group) << Show(err);
+        commit_error = err;
+        __atomic_store_n(&committed, group, __ATOMIC_RELEASE);
+        return err;
+    }
+
+    // Commits first once enough blocks are pinned dirty, so that operations
+    // don't keep piling into a transaction that outgrows the journal
+    static void begin_operation()
+    {
+        if (__atomic_load_n(&dirty_blocks, __ATOMIC_RELAXED) >= commit_threshold)
+            flush();
+        pthread_rwlock_rdlock(&txn_lock);
+    }
+
+    // Commits once enough blocks are pinned dirty
+    static void end_operation()
+    {
+        pthread_rwlock_unlock(&txn_lock);
+        if (__atomic_load_n(&dirty_blocks, __ATOMIC_RELAXED) >= commit_threshold)
+            flush();
+    }
+
     static void __flush()
     {
         Info;
+        flush();
     }
     template <int bias, typename BlockType>
     static bool read(int blockno, BlockType &block)
@@ -532,30 +2546,58 @@ public:
         return BlockProxy<BlockType>(blockno);
     }
 
-    static auto get_header()
+    template <typename BlockType>
+    static BlockProxy<BlockType> from_blockno(int blockno, Overwrite)
     {
-        return BlockProxy<HeaderBlock>(0);
+        return BlockProxy<BlockType>(blockno, overwrite);
     }
 
-    static int alloc_inode()
+    // Layout fields only, they never change after mount
+    static const HeaderBlock &header()
     {
-        auto header = get_header();
-        if (header->inode_num_free == 0)
-        {
-            header.drop();
+        return superblock;
+    }
+
+    // Consistent copy including the free counters
+    static HeaderBlock usage()
+    {
+        MutexLock _(alloc_lock);
+        return superblock;
+    }
+
+    // A file goes into the group of its parent, a directory into the group
+    // with the most free data blocks among those with a free inode, so that
+    // separate trees spread out and each keeps its files together
+    static int alloc_inode(int parent = -1, bool directory = false)
+    {
+        Stats::Scope stats(Stats::ALLOC_INODE);
+        MutexLock _(alloc_lock);
+        auto &&header = superblock;
+        if (header.inode_num_free == 0)
             return -1;
-        }
-        auto bitmap = BitMap(header->inode_bitmap_offset, header->data_block_bitmap_offset, inode_bitmap_min_pos);
-        auto ret = bitmap.get_first_zero();
+        int group = parent == -1 ? 0 : parent / header.group_inodes();
+        if (directory)
+            for (uint32_t now = 0; now < header.group_num; now++)
+                if (inode_summary.blocks[now].free &&
+                    (!inode_summary.blocks[group].free || data_summary.blocks[now].free > data_summary.blocks[group].free))
+                    group = now;
+        int goal = group * header.group_inodes(), ret = -1;
+        if (goal > inode_bitmap_min_pos)
+            ret = BitMap(header.inode_bitmap_offset, header.data_block_bitmap_offset, inode_summary, goal).get_first_zero();
+        bool first_fit = ret == -1; // then nothing below ret is free
+        auto bitmap = BitMap(header.inode_bitmap_offset, header.data_block_bitmap_offset, inode_summary, inode_bitmap_min_pos);
+        if (first_fit)
+            ret = bitmap.get_first_zero();
 
         // This should never happen
         assert(ret != -1);
 
         bitmap.set(ret);
-        header->inode_num_free -= 1;
-        header.commit();
+        header.inode_num_free -= 1;
+        superblock_dirty = true;
 
-        inode_bitmap_min_pos = std::max(inode_bitmap_min_pos, ret);
+        if (first_fit)
+            inode_bitmap_min_pos = ret;
 
         Info << Show(ret) << Show(inode_bitmap_min_pos);
 
@@ -564,80 +2606,343 @@ public:
 
     static void free_inode(int inodeno)
     {
+        MutexLock _(alloc_lock);
         Info << Show(inodeno);
-        auto header = get_header();
-        auto bitmap = BitMap(header->inode_bitmap_offset, header->data_block_bitmap_offset);
+        auto &&header = superblock;
+        auto bitmap = BitMap(header.inode_bitmap_offset, header.data_block_bitmap_offset, inode_summary);
         assert(bitmap.get(inodeno));
         bitmap.clear(inodeno);
-        header->inode_num_free += 1;
-        header.commit();
+        header.inode_num_free += 1;
+        superblock_dirty = true;
 
         inode_bitmap_min_pos = std::min(inode_bitmap_min_pos, inodeno);
     }
 
-    static int alloc_data()
+    // Records an inode that may outlive its last name, false when the list is
+    // full: a crash before it is freed then leaks it
+    static bool add_orphan(int inodeno)
     {
-        auto header = get_header();
-        if (header->data_block_num_free == 0)
+        MutexLock _(alloc_lock);
+        if (superblock.orphan_num == HeaderBlock::ORPHAN_SLOTS)
         {
-            header.drop();
-            return -1;
+            Error << "Orphan list full" << Show(inodeno);
+            return false;
         }
-        auto bitmap = BitMap(header->data_block_bitmap_offset, header->inode_block_offset, data_bitmap_min_pos);
-        auto ret = bitmap.get_first_zero();
+        superblock.orphans[superblock.orphan_num++] = inodeno;
+        superblock_dirty = true;
+        return true;
+    }
+
+    // Searched from the end, where the inode an unlink frees right away is
+    static void remove_orphan(int inodeno)
+    {
+        MutexLock _(alloc_lock);
+        for (int i = superblock.orphan_num - 1; i >= 0; i--)
+            if (superblock.orphans[i] == uint32_t(inodeno))
+            {
+                superblock.orphans[i] = superblock.orphans[--superblock.orphan_num];
+                superblock_dirty = true;
+                return;
+            }
+    }
+
+    // The last inode on the orphan list, -1 when there is none
+    static int last_orphan()
+    {
+        MutexLock _(alloc_lock);
+        return superblock.orphan_num ? superblock.orphans[superblock.orphan_num - 1] : -1;
+    }
+
+    static int alloc_data(int goal = 0)
+    {
+        int count;
+        return alloc_data_run(1, count, goal);
+    }
+
+    // Allocates up to want contiguous data blocks with one bitmap and one header
+    // write, returns the first one and the run length in count, -1 when full.
+    // The search starts at block goal, or at the data of the group goal is in,
+    // and wraps around
+    static int alloc_data_run(int want, int &count, int goal = 0)
+    {
+        Stats::Scope stats(Stats::ALLOC_DATA);
+        MutexLock _(alloc_lock);
+        auto &&header = superblock;
+        if (header.data_block_num_free == 0)
+            return -1;
+        int start = 0, ret = -1;
+        if (goal >= int(header.group_offset) && goal < block_num && header.group_of(goal) < header.group_num)
+            start = header.data_no(std::max(goal, header.group_start(header.group_of(goal)) + int(header.group_inode_blocks)));
+        if (start > data_bitmap_min_pos)
+            ret = BitMap(header.data_block_bitmap_offset, header.group_offset, data_summary, start).get_first_zero();
+        bool first_fit = ret == -1; // then nothing below ret is free
+        auto bitmap = BitMap(header.data_block_bitmap_offset, header.group_offset, data_summary, data_bitmap_min_pos);
+        if (first_fit)
+            ret = bitmap.get_first_zero();
 
         // This should never happen
         assert(ret != -1);
 
-        data_bitmap_min_pos = std::max(data_bitmap_min_pos, ret);
+        // A run ends at the set bits past the end of its group, so it is
+        // contiguous on the disk
+        count = bitmap.get_zero_run(ret, want);
+        if (first_fit)
+            data_bitmap_min_pos = ret + count - 1;
 
-        bitmap.set(ret);
-        header->data_block_num_free -= 1;
-        ret += header->data_block_offset;
-        header.commit();
+        bitmap.set_run(ret, count);
+        header.data_block_num_free -= count;
+        ret = header.data_block(ret);
+        Stats::count(Stats::DATA_BLOCKS_ALLOCATED, count);
+        superblock_dirty = true;
 
-        Debug << Show(ret) << Show(data_bitmap_min_pos);
+        Debug << Show(ret) << Show(count) << Show(data_bitmap_min_pos);
 
         return ret;
     }
 
-    static void free_data(int datano)
+    static void free_data(int blockno)
     {
-        Debug << Show(datano);
-        auto header = get_header();
-        datano -= header->data_block_offset;
+        MutexLock _(alloc_lock);
+        Debug << Show(blockno);
+        auto &&header = superblock;
+        assert(blockno >= int(header.group_offset) && header.group_of(blockno) < header.group_num);
+        int datano = header.data_no(blockno);
         assert(datano >= 0);
-        auto bitmap = BitMap(header->data_block_bitmap_offset, header->inode_block_offset);
+        auto bitmap = BitMap(header.data_block_bitmap_offset, header.group_offset, data_summary);
         assert(bitmap.get(datano));
         bitmap.clear(datano);
-        header->data_block_num_free += 1;
-        header.commit();
+        header.data_block_num_free += 1;
+        superblock_dirty = true;
 
         data_bitmap_min_pos = std::min(data_bitmap_min_pos, datano);
     }
 
-    static int mkfs()
+    // Longest run read_run/write_run take
+    static inline constexpr int RUN_MAX = 256;
+
+    // Reads count consecutive data blocks into target. Cached blocks are copied
+    // out, the rest come in with one disk_readv per gap and join the cache,
+    // unless the disk is mapped and the kernel already caches them
+    static int read_run(int blockno, int count, char *target)
     {
-        Info;
-        atexit(&__flush);
+        assert(count > 0 && count <= RUN_MAX);
+        Stats::Scope stats(Stats::RUN_READ);
+        if (blockno < 0 || blockno > block_num - count)
+            return 1;
+        iovec iov[RUN_MAX];
+        for (int i = 0; i < count; i++)
+            iov[i] = {target + size_t(i) * BLOCK_SIZE, BLOCK_SIZE};
+
+        bool hit[RUN_MAX];
+        for (int i = 0; i < count; i++)
+        {
+            auto &&shard = cache_shard(blockno + i);
+            MutexLock _(shard.lock);
+            int slot = shard.cache_lookup(blockno + i);
+            Stats::count(slot != -1 ? Stats::CACHE_HITS : Stats::CACHE_MISSES);
+            if ((hit[i] = slot != -1))
+            {
+                shard.cache_touch(slot, cache_level(DataBlock::bias));
+                memcpy(target + size_t(i) * BLOCK_SIZE, shard.cache[slot].data, BLOCK_SIZE);
+            }
+        }
+        for (int i = 0, j; i < count; i = j)
+        {
+            for (j = i; j < count && hit[j] == hit[i]; j++)
+                ;
+            if (hit[i])
+                continue;
+            if (int err = device_readv(blockno + i, iov + i, j - i))
+            {
+                Error << Show(blockno + i) << Show(j - i) << Show(err);
+                return err;
+            }
+        }
+        if (map_base)
+            return 0;
+        for (int i = 0; i < count; i++)
+        {
+            if (hit[i])
+                continue;
+            auto &&shard = cache_shard(blockno + i);
+            MutexLock _(shard.lock);
+            if (shard.cache_lookup(blockno + i) != -1)
+                continue; // readahead got there first, with the same contents
+            int slot = shard.cache_take(blockno + i, cache_level(DataBlock::bias));
+            if (slot != -1)
+                memcpy(shard.cache[slot].data, target + size_t(i) * BLOCK_SIZE, BLOCK_SIZE);
+        }
+        return 0;
+    }
+
+    // Overwrites count consecutive data blocks from source. Cached blocks, and
+    // those the journal holds, are updated in the cache, the rest go straight to the disk with one
+    // disk_writev per gap and then join the cache clean. The caller holds the
+    // lock of the inode owning them, so only readahead can pull one in meanwhile,
+    // and the last pass overwrites what it brought.
+    static int write_run(int blockno, int count, const char *source)
+    {
+        assert(count > 0 && count <= RUN_MAX);
+        Stats::Scope stats(Stats::RUN_WRITE);
+        if (blockno < 0 || blockno > block_num - count)
+            return 1;
+        iovec iov[RUN_MAX];
+        for (int i = 0; i < count; i++)
+            iov[i] = {const_cast<char *>(source) + size_t(i) * BLOCK_SIZE, BLOCK_SIZE};
+
+        bool hit[RUN_MAX];
+        for (int i = 0; i < count; i++)
+        {
+            auto &&shard = cache_shard(blockno + i);
+            MutexLock _(shard.lock);
+            int slot = shard.cache_lookup(blockno + i);
+            if (slot == -1 && logged(blockno + i)) // a replay would put an older image over a direct write
+                if ((slot = shard.cache_take(blockno + i, cache_level(DataBlock::bias))) == -1)
+                    return 1;
+            if ((hit[i] = slot != -1))
+            {
+                shard.cache_touch(slot, cache_level(DataBlock::bias));
+                if (int err = shard.cache_dirty(slot))
+                    return err;
+                memcpy(shard.cache[slot].data, source + size_t(i) * BLOCK_SIZE, BLOCK_SIZE);
+            }
+        }
+        for (int i = 0, j; i < count; i = j)
+        {
+            for (j = i; j < count && hit[j] == hit[i]; j++)
+                ;
+            if (hit[i])
+                continue;
+            if (int err = device_writev(blockno + i, iov + i, j - i))
+            {
+                Error << Show(blockno + i) << Show(j - i) << Show(err);
+                return err;
+            }
+        }
+        for (int i = 0; i < count; i++)
+        {
+            if (hit[i])
+                continue;
+            auto &&shard = cache_shard(blockno + i);
+            MutexLock _(shard.lock);
+            int slot = shard.cache_lookup(blockno + i);
+            if (slot == -1 && map_base)
+                continue; // the mapping holds what was written
+            if (slot == -1 && (slot = shard.cache_take(blockno + i, cache_level(DataBlock::bias))) == -1)
+                continue; // nothing older is cached to go stale
+            memcpy(shard.cache[slot].data, source + size_t(i) * BLOCK_SIZE, BLOCK_SIZE);
+        }
+        return 0;
+    }
+
+    // Bring a data block into the cache without copying it out
+    static void prefetch(int blockno)
+    {
+        if (blockno >= block_num || blockno < 0 || map_base)
+            return;
+        auto &&shard = cache_shard(blockno);
+        MutexLock _(shard.lock);
+        if (shard.cache_lookup(blockno) != -1)
+            return;
+        int slot = shard.cache_take(blockno, cache_level(DataBlock::bias));
+        if (slot != -1 && device_read(blockno, shard.cache[slot].data))
+            shard.cache_release(slot);
+    }
+
+    // Mounts the filesystem already on the disk. ENODEV when block 0 carries no
+    // magic, a fresh disk; EPROTO when it was made by another format version,
+    // EMEDIUMTYPE when by a build with another BLOCK_SIZE, ENOSPC when the
+    // device is smaller than the filesystem, EINVAL when its superblock or
+    // journal header does not add up, EIO or ENOMEM when the disk or the journal
+    // replay fails. The disk is left as it was, the device is never resized
+    static int mount()
+    {
+        attach();
+        // The layout never changes after mkfs, which puts block 0 in place last, so
+        // the copy on the disk tells the size and where the journal is
+        HeaderBlock layout;
+        {
+            DataBlock block;
+            if (device_read(0, &block))
+                return EIO;
+            memcpy(&layout, block.data, sizeof(layout));
+        }
+        Info << Show(layout.MAGIC_NUMBER) << Show(layout.format_version) << Show(layout.block_num);
+        if (layout.MAGIC_NUMBER != HeaderBlock::MAGIC_NUMBER_VAL)
+            return ENODEV;
+        if (layout.format_version != HeaderBlock::FORMAT_VERSION)
+            return EPROTO;
+        formatted = layout;
+        if (layout.block_size != BLOCK_SIZE)
+            return EMEDIUMTYPE;
+        if (!layout.valid())
+            return EINVAL;
+        if (layout.block_num > uint32_t(block_num))
+            return ENOSPC;
+        // A larger device keeps its size, only the blocks of the filesystem are used
+        block_num = layout.block_num;
+        journal_live.assign((block_num + 63) / 64, 0);
+        if (int err = replay(layout))
+        {
+            Error << "Journal replay failed" << Show(err);
+            return err;
+        }
+        auto header = from_blockno<const HeaderBlock>(0);
+        if (header)
+            return EIO;
+        if (!header->valid() || !header->same_layout(layout))
+            return EINVAL;
+        superblock = *header;
+        superblock_dirty = false;
+        summarize();
+        return 0;
+    }
+
+    // Formats a filesystem of blocks blocks, or of the size of the device
+    // when that is 0
+    static int mkfs(int blocks = 0)
+    {
+        Info << Show(blocks);
+        attach();
+        if (blocks == 0)
+            blocks = block_num;
+        if (blocks < int(HeaderBlock::MIN_BLOCKS) || resize(blocks))
+            return 1;
         // Initialize metadata
         {
             // Initialize header
-            auto header = from_blockno<HeaderBlock>(0);
-            new (&*header) HeaderBlock;
-            header.commit();
+            superblock = HeaderBlock(blocks);
+            // Records an old filesystem left in the journal must not pass for ours
+            journal_sequence = uint32_t(time(NULL));
+            journal_head = 1;
+            std::fill(journal_live.begin(), journal_live.end(), 0);
             {
-                // Initialize bitmap
-                auto bitmap = from_blockno<BitmapBlock>(1);
-                memset(&*bitmap, 0, BLOCK_SIZE);
-
-                for (int i = 1; i < header->inode_block_offset; i++)
+                // Until the end, block 0 holds no filesystem at all: a crash in
+                // between leaves a disk that gets formatted again, not half of one
+                DataBlock block = {};
+                if (device_write(0, &block) || device_sync())
+                    return 1;
+            }
+            if (write_journal_header()) // before anything of the new filesystem can be logged
+                return 1;
+            write_header();
+            {
+                // Initialize bitmap, the bits past the end of each group set
+                auto bitmap = from_blockno<BitmapBlock>(superblock.inode_bitmap_offset, overwrite);
+                for (uint32_t group = 0; group < superblock.group_num; group++)
                 {
-                    bitmap.setBlockNo(i);
+                    bitmap.setBlockNo(superblock.inode_bitmap_offset + group);
+                    memset(&*bitmap, 0, BLOCK_SIZE);
+                    bitmap->set_run(superblock.group_inodes(), HeaderBlock::GROUP_BITS - superblock.group_inodes());
+                    bitmap.commit();
+                    bitmap.setBlockNo(superblock.data_block_bitmap_offset + group);
+                    memset(&*bitmap, 0, BLOCK_SIZE);
+                    bitmap->set_run(superblock.group_data(group), HeaderBlock::GROUP_BITS - superblock.group_data(group));
                     bitmap.commit();
                 }
             }
         }
+        summarize();
         // Initialize root
 
         int rootINodeNo = alloc_inode();
@@ -651,38 +2956,382 @@ public:
         DataProxy root(rootINodeNo);
         root.resize(0);
 
-        return 0;
+        // Commit it all and write it in place, block 0 with the rest, so the
+        // filesystem is there for mount whatever happens next
+        if (flush())
+            return 1;
+        for (auto &&shard : cache_shards)
+            pthread_mutex_lock(&shard.lock.native);
+        int err = checkpoint();
+        for (auto &&shard : cache_shards)
+            pthread_mutex_unlock(&shard.lock.native);
+        return err ? 1 : 0;
+    }
+};
+
+inline Disk::CacheShard Disk::cache_shards[Disk::CACHE_SHARDS];
+
+// Brackets one filesystem operation, so that a journal commit sees all of its
+// changes or none. Take it before any inode lock, and never nest it.
+struct Transaction
+{
+    Transaction()
+    {
+        Disk::begin_operation();
+    }
+
+    ~Transaction()
+    {
+        Disk::end_operation();
+    }
+};
+
+// Background thread that pulls data blocks into the block cache ahead of
+// sequential readers. It starts with the first request, after FUSE has
+// daemonized; requests beyond a full queue are dropped
+class Readahead
+{
+    static inline constexpr unsigned QUEUE = 4096;
+    inline static int queue[QUEUE];
+    inline static unsigned head = 0, tail = 0; // pending requests are [head, tail)
+    inline static Mutex lock;
+    inline static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+    inline static bool started = false;
+
+    static void *worker(void *)
+    {
+        for (;;)
+        {
+            int blockno;
+            {
+                MutexLock _(lock);
+                while (head == tail)
+                    pthread_cond_wait(&wake, &lock.native);
+                blockno = queue[head++ % QUEUE];
+            }
+            Disk::prefetch(blockno);
+        }
+        return nullptr;
+    }
+
+public:
+    static void submit(const int *blocks, int count)
+    {
+        MutexLock _(lock);
+        if (!started)
+        {
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, worker, NULL))
+                return;
+            pthread_detach(thread);
+            started = true;
+        }
+        for (int i = 0; i < count && tail - head < QUEUE; i++)
+            queue[tail++ % QUEUE] = blocks[i];
+        pthread_cond_signal(&wake);
+    }
+};
+
+// What fuse_file_info::fh points to for an open file
+struct OpenFile
+{
+    static inline constexpr int READAHEAD_MIN = 32, READAHEAD_MAX = 512; // in blocks
+
+    int inodeno;
+    Mutex lock;
+    size_t next_offset = 0; // where a sequential read continues
+    int ahead = 0;          // data blocks below this were already read ahead
+    int window = 0;         // doubles on every sequential read, 0 after a seek
+    // Directories: the entries as the listing from offset 0 found them,
+    // packed as on disk, so the reads that continue it see the same ones.
+    // /.fsstats: the snapshot taken at open
+    std::vector<char, malloc_allocator<char>> listing;
+
+    OpenFile(int inodeno) : inodeno(inodeno) {}
+
+    static OpenFile *from(struct fuse_file_info *fi)
+    {
+        return reinterpret_cast<OpenFile *>(fi->fh);
+    }
+
+    // Track a read of [offset, offset + size), true with the blocks to read ahead
+    bool advance(size_t offset, size_t size, int &first, int &count)
+    {
+        MutexLock _(lock);
+        bool sequential = offset == next_offset;
+        next_offset = offset + size;
+        if (!sequential)
+        {
+            window = ahead = 0;
+            return false;
+        }
+        window = window ? std::min(window * 2, READAHEAD_MAX) : READAHEAD_MIN;
+        int end = (next_offset + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        first = std::max(ahead, end);
+        count = end + window - first;
+        if (count <= 0)
+            return false;
+        ahead = first + count;
+        return true;
+    }
+};
+
+// Delayed allocation for appends: writes past the end of a file collect in a
+// per-inode buffer of whole blocks and only get disk blocks, in one resize,
+// when it is flushed. That happens on close, fsync, truncate, when it fills
+// up, or before a write it cannot take. The caller holds the inode's lock,
+// exclusive to change the buffer; only size() may be called without it.
+class WriteBuffer
+{
+    static inline constexpr size_t CAPACITY = 256 * BLOCK_SIZE;
+    static inline constexpr int BUFFERS = 16;
+
+    struct Buffer
+    {
+        bool used;
+        int inodeno;
+        size_t base, end; // data holds [base, end), base is block aligned
+        int reserved;     // blocks the flush will allocate, kept back from other buffers
+        char *data;
+    };
+
+    inline static Buffer buffers[BUFFERS];
+    inline static int reserved = 0;
+    inline static Mutex lock; // guards the table and every end and reserved, not the data
+
+    static Buffer *find(int inodeno)
+    {
+        for (auto &&buffer : buffers)
+            if (buffer.used && buffer.inodeno == inodeno)
+                return &buffer;
+        return nullptr;
+    }
+
+    // Blocks a flush needs for [0, end) when filesize bytes are allocated, with
+    // room for the pointer blocks a run of CAPACITY can add
+    static int blocks_needed(size_t end, size_t filesize)
+    {
+        return (end + BLOCK_SIZE - 1) / BLOCK_SIZE - (filesize + BLOCK_SIZE - 1) / BLOCK_SIZE + 2;
+    }
+
+    static void release(Buffer *buffer)
+    {
+        MutexLock _(lock);
+        reserved -= buffer->reserved;
+        buffer->used = false;
+    }
+
+public:
+    // Takes the write if it appends and fits, false if it must go to the disk.
+    // The caller holds the inode's lock and an open handle, which keeps it from
+    // being freed, and free_node discards the buffer under that same lock. An
+    // unlinked inode gets no new buffer, its data goes with its last handle
+    static bool write(int inodeno, size_t offset, size_t size, const void *data)
+    {
+        if (INodeRefs::unlinked(inodeno))
+            return false;
+        size_t filesize = INodeProxy(inodeno).drop()->filesize;
+        Buffer *buffer;
+        {
+            MutexLock _(lock);
+            buffer = find(inodeno);
+            if (buffer == nullptr)
+            {
+                size_t base = filesize / BLOCK_SIZE * BLOCK_SIZE;
+                if (offset + size <= filesize || offset < base || offset + size - base > CAPACITY)
+                    return false;
+                for (auto &&now : buffers)
+                    if (!now.used && (now.data || (now.data = static_cast<char *>(malloc(CAPACITY)))))
+                    {
+                        buffer = &now;
+                        break;
+                    }
+                if (buffer == nullptr)
+                    return false;
+                *buffer = {true, inodeno, base, base, 0, buffer->data};
+                static bool attached = false;
+                if (!attached) // registered after the disk's, so it runs before its final flush
+                    attached = !atexit([] { flush_all(); });
+            }
+            if (offset < buffer->base || offset + size - buffer->base > CAPACITY)
+                return false;
+            int need = blocks_needed(std::max(buffer->end, offset + size), filesize);
+            if (need > buffer->reserved)
+            {
+                if (reserved + need - buffer->reserved > (int)Disk::usage().data_block_num_free)
+                    return false;
+                reserved += need - buffer->reserved;
+                buffer->reserved = need;
+            }
+        }
+        if (buffer->end == buffer->base && filesize > buffer->base) // pick up the partial tail block
+            buffer->end = buffer->base + DataProxy(inodeno).load(buffer->base, filesize - buffer->base, buffer->data);
+        if (offset > buffer->end)
+            memset(buffer->data + (buffer->end - buffer->base), 0, offset - buffer->end);
+        memcpy(buffer->data + (offset - buffer->base), data, size);
+        {
+            MutexLock _(lock);
+            buffer->end = std::max(buffer->end, offset + size);
+        }
+
+        auto inode = INodeProxy(inodeno);
+        inode->mtime = time(NULL);
+        inode.commit();
+        return true;
+    }
+
+    // Serves a read of a buffered file, false if the inode has no buffer
+    static bool read(int inodeno, size_t offset, size_t size, void *target, size_t &done)
+    {
+        Buffer *buffer;
+        {
+            MutexLock _(lock);
+            if ((buffer = find(inodeno)) == nullptr)
+                return false;
+        }
+        auto inode = INodeProxy(inodeno);
+        if (inode.access())
+            inode.commit();
+        else
+            inode.drop();
+
+        done = 0;
+        if (offset >= buffer->end)
+            return true;
+        size = std::min(size, buffer->end - offset);
+        if (offset < buffer->base)
+        {
+            done = DataProxy(inodeno).load(offset, std::min(size, buffer->base - offset), target);
+            offset += done;
+            size -= done;
+            target = static_cast<char *>(target) + done;
+        }
+        if (size && offset >= buffer->base)
+        {
+            memcpy(target, buffer->data + (offset - buffer->base), size);
+            done += size;
+        }
+        return true;
+    }
+
+    // Allocates and writes out the buffer of an inode, if any
+    static int flush(int inodeno)
+    {
+        Buffer *buffer;
+        {
+            MutexLock _(lock);
+            if ((buffer = find(inodeno)) == nullptr)
+                return 0;
+        }
+        DataProxy data(inodeno);
+        int err = 0;
+        if (buffer->end > INodeProxy(inodeno).drop()->filesize)
+            err = data.resize(buffer->end, buffer->end - buffer->base);
+        if (!err && buffer->end > buffer->base)
+            data.write(buffer->base, buffer->end - buffer->base, buffer->data);
+        Debug << Show(inodeno) << Show(buffer->base) << Show(buffer->end) << Show(err);
+        release(buffer);
+        return err;
+    }
+
+    // Drops the buffer of an inode whose data is going away
+    static void discard(int inodeno)
+    {
+        Buffer *buffer;
+        {
+            MutexLock _(lock);
+            if ((buffer = find(inodeno)) == nullptr)
+                return;
+        }
+        release(buffer);
+    }
+
+    // Flushes every buffer, each in its own transaction; the caller holds no lock
+    static int flush_all()
+    {
+        int err = 0;
+        for (auto &&buffer : buffers)
+        {
+            int inodeno;
+            {
+                MutexLock _(lock);
+                if (!buffer.used)
+                    continue;
+                inodeno = buffer.inodeno;
+            }
+            Transaction transaction;
+            WriteLock _(INodeLocks::of(inodeno));
+            if (int _ = flush(inodeno))
+                err = _;
+        }
+        return err;
+    }
+
+    // The size a buffered file will have once flushed
+    static bool size(int inodeno, size_t &size)
+    {
+        MutexLock _(lock);
+        auto buffer = find(inodeno);
+        if (buffer == nullptr)
+            return false;
+        size = buffer->end;
+        return true;
     }
 };
 
+template <typename T>
+typename BlockProxy<T>::value_type *BlockProxy<T>::locate(int blockno)
+{
+    // Only contents, read under the lock of their inode, so no write can land
+    // in the cache while the mapped block is in use
+    if (!readonly || T::bias != DataBlock::bias || !Disk::mapped() || blockno < 0 || blockno >= Disk::blocks() ||
+        Disk::cached(blockno))
+        return nullptr;
+    return reinterpret_cast<value_type *>(Disk::mapped() + size_t(blockno) * BLOCK_SIZE);
+}
+
 template <typename T>
 BlockProxy<T>::BlockProxy(int blockno)
-    : closed(false), error(false), blockno(blockno), block(*reinterpret_cast<value_type *>(&data_storage))
+    : closed(readonly), error(false), blockno(blockno), block(locate(blockno) ? *locate(blockno) : storage())
 {
-    if (!(blockno >= 0 && blockno < BLOCK_NUM))
+    if (!(blockno >= 0 && blockno < Disk::blocks()))
     {
         Error << Show(blockno);
-        assert(blockno >= 0 && blockno < BLOCK_NUM);
+        assert(blockno >= 0 && blockno < Disk::blocks());
     }
-    error = Disk::read<T::bias>(blockno, block);
+    if (!is_mapped())
+        error = Disk::read<T::bias>(blockno, block);
 
-    Debug << Show(blockno) << Show(error);
+    Debug << Show(blockno) << Show(error) << Show(is_mapped());
 }
 
 template <typename T>
 void BlockProxy<T>::apply()
 {
+    static_assert(!readonly, "read-only blocks can't be written back");
     assert(!closed);
     error = Disk::write<T::bias>(blockno, block);
     Debug << Show(blockno) << Show(error);
 }
 
+void FreeSummary::build(int start, int end)
+{
+    blocks.resize(end - start);
+    for (int i = 0; i < end - start; i++)
+    {
+        auto block = Disk::from_blockno<const BitmapBlock>(start + i);
+        blocks[i].free = block->count_free();
+        block->summarize(blocks[i].nonfull);
+    }
+}
+
 void BitMap::set(int pos)
 {
     Debug << Show(pos);
     auto [blockno, offset] = unpack(pos);
     auto block = Disk::from_blockno<BitmapBlock>(blockno + start);
     block->set(offset);
+    summary.update(blockno, *block, offset / 64, offset / 64, -1);
     block.commit();
 }
 
@@ -692,13 +3341,14 @@ void BitMap::clear(int pos)
     auto [blockno, offset] = unpack(pos);
     auto block = Disk::from_blockno<BitmapBlock>(blockno + start);
     block->clear(offset);
+    summary.update(blockno, *block, offset / 64, offset / 64, 1);
     block.commit();
 }
 
 bool BitMap::get(int pos)
 {
     auto [blockno, offset] = unpack(pos);
-    auto block = Disk::from_blockno<BitmapBlock>(blockno + start).drop();
+    auto block = Disk::from_blockno<const BitmapBlock>(blockno + start);
     auto ret = block->get(offset);
     Debug << Show(pos) << Show(ret);
     return ret;
@@ -710,13 +3360,12 @@ int BitMap::get_first_zero()
     auto [blockoff, off] = unpack(minpos);
     for (int pos = start + blockoff, blockno = blockoff; pos < end; pos++, blockno++)
     {
-        auto block = Disk::from_blockno<BitmapBlock>(pos);
-        int _ = block->get_first_zero(off);
+        int word = summary.find(blockno, off / 64);
         off = 0;
-        block.drop();
-        if (_ != -1)
+        if (word != -1)
         {
-            ret = _ + blockno * siz;
+            auto block = Disk::from_blockno<const BitmapBlock>(pos);
+            ret = blockno * siz + word * 64 + __builtin_ctzll(~block->data[word]);
             break;
         }
     }
@@ -724,108 +3373,294 @@ int BitMap::get_first_zero()
     return ret;
 }
 
-INodeProxy::INodeProxy(int inodeno)
-    : inodeno(inodeno)
+int BitMap::get_zero_run(int pos, int limit)
+{
+    auto [blockno, offset] = unpack(pos);
+    auto block = Disk::from_blockno<const BitmapBlock>(blockno + start);
+    return block->count_zero(offset, limit);
+}
+
+void BitMap::set_run(int pos, int count)
+{
+    Debug << Show(pos) << Show(count);
+    auto [blockno, offset] = unpack(pos);
+    auto block = Disk::from_blockno<BitmapBlock>(blockno + start);
+    block->set_run(offset, count);
+    summary.update(blockno, *block, offset / 64, (offset + count - 1) / 64, -count);
+    block.commit();
+}
+
+INodeCache::Entry *INodeCache::take(int inodeno)
 {
-    auto header = Disk::get_header();
-    header.drop();
-    int blockno = inodeno / INodeBlock::INODE_IN_BLOCK + header->inode_block_offset;
+    auto &&ways = entries[set(inodeno)];
+    for (auto &&way : ways)
+        if (!way.valid)
+            return &way;
+    for (int i = 0; i < WAYS; i++)
+    {
+        auto &&way = ways[hands[set(inodeno)]++ % WAYS];
+        if (way.pins)
+            continue;
+        if (way.dirty && store(way.inodeno, way.inode))
+            continue;
+        way.valid = false;
+        return &way;
+    }
+    return nullptr;
+}
+
+bool INodeCache::load(int inodeno, INodeBlock::INode &inode)
+{
+    int blockno = Disk::header().inode_block(inodeno);
     int offset = inodeno % INodeBlock::INODE_IN_BLOCK;
 
-    auto block = Disk::from_blockno<INodeBlock>(blockno);
-    error = block;
+    auto block = Disk::from_blockno<const INodeBlock>(blockno);
+    if (block)
+        return true;
     inode = block->inodes[offset];
-    block.drop();
-    Debug << Show(inodeno) << Show(error);
+    return false;
 }
 
-void INodeProxy::apply()
+bool INodeCache::store(int inodeno, const INodeBlock::INode &inode)
 {
-    auto header = Disk::get_header();
-    header.drop();
-    int blockno = inodeno / INodeBlock::INODE_IN_BLOCK + header->inode_block_offset;
+    int blockno = Disk::header().inode_block(inodeno);
     int offset = inodeno % INodeBlock::INODE_IN_BLOCK;
 
     auto block = Disk::from_blockno<INodeBlock>(blockno);
-
     if (block)
-    {
-        error = true;
-        return;
-    }
-
+        return true;
     block->inodes[offset] = inode;
     block.commit();
-    error = block;
-    Debug << Show(inodeno) << Show(error);
+    return block;
 }
 
-inline int DataProxy::get_block_size()
+bool INodeCache::get(int inodeno, INodeBlock::INode &inode)
 {
-    auto inode = INodeProxy(inodeno).drop(); //read only
-    auto pointers = BlockProxy<PointerBlock>();
-    size_t now_block = 0;
-
-    if (inode->direct_pointer == 0)
-        goto BLOCK_COUNT_END;
-
-    now_block++;
+    MutexLock _(locks[stripe(inodeno)]);
+    if (auto entry = find(inodeno))
+    {
+        inode = entry->inode;
+        return false;
+    }
+    if (load(inodeno, inode))
+        return true;
+    if (auto entry = take(inodeno))
+        *entry = {true, false, inodeno, 0, inode};
+    return false;
+}
 
-    if (inode->indirect_pointer == 0)
-        goto BLOCK_COUNT_END;
+bool INodeCache::get_many(const int *inodenos, int count, INodeBlock::INode *inodes)
+{
+    // In inode order, so the inodes of one INodeBlock come together
+    std::vector<int, malloc_allocator<int>> order(count);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return inodenos[a] < inodenos[b]; });
 
-    pointers.~BlockProxy();
-    new (&pointers) BlockProxy<PointerBlock>(inode->indirect_pointer);
-    pointers.drop();
+    for (int first = 0, last; first < count; first = last)
+    {
+        int inodeblock = inodenos[order[first]] / INodeBlock::INODE_IN_BLOCK;
+        for (last = first; last < count && inodenos[order[last]] / INodeBlock::INODE_IN_BLOCK == inodeblock; last++)
+            ;
+        MutexLock _(locks[stripe(inodenos[order[first]])]);
+        bool missed = false;
+        for (int now = first; now < last; now++)
+            if (auto entry = find(inodenos[order[now]]))
+                inodes[order[now]] = entry->inode;
+            else
+                missed = true;
+        if (!missed)
+            continue;
+
+        auto block = Disk::from_blockno<const INodeBlock>(Disk::header().inode_block(inodeblock * INodeBlock::INODE_IN_BLOCK));
+        if (block)
+            return true;
+        for (int now = first; now < last; now++)
+        {
+            int inodeno = inodenos[order[now]];
+            auto &&inode = inodes[order[now]];
+            if (auto entry = find(inodeno))
+            {
+                inode = entry->inode;
+                continue;
+            }
+            inode = block->inodes[inodeno % INodeBlock::INODE_IN_BLOCK];
+            if (auto entry = take(inodeno))
+                *entry = {true, false, inodeno, 0, inode};
+        }
+    }
+    return false;
+}
 
-    for (auto &&pointer : pointers->pointers)
+bool INodeCache::put(int inodeno, const INodeBlock::INode &inode)
+{
+    MutexLock _(locks[stripe(inodeno)]);
+    auto entry = find(inodeno);
+    if (entry == nullptr)
     {
-        if (pointer == 0)
-            goto BLOCK_COUNT_END;
-        now_block++;
+        if ((entry = take(inodeno)) == nullptr)
+            return store(inodeno, inode);
+        *entry = {true, false, inodeno, 0, inode};
     }
+    entry->inode = inode;
+    entry->dirty = true;
+    return false;
+}
 
-    if (inode->iindirect_pointer == 0)
-        goto BLOCK_COUNT_END;
+void INodeCache::pin(int inodeno)
+{
+    INodeBlock::INode inode;
+    if (get(inodeno, inode))
+        return;
+    MutexLock _(locks[stripe(inodeno)]);
+    if (auto entry = find(inodeno))
+        entry->pins++;
+}
 
-    pointers.~BlockProxy();
-    new (&pointers) BlockProxy<PointerBlock>(inode->iindirect_pointer);
-    pointers.drop();
+void INodeCache::unpin(int inodeno)
+{
+    MutexLock _(locks[stripe(inodeno)]);
+    auto entry = find(inodeno);
+    if (entry && entry->pins)
+        entry->pins--;
+}
 
-    for (int now = 0; now < PointerBlock::POINTER_PER_BLOCK; now++)
+int INodeCache::flush()
+{
+    int err = 0, count = 0;
+    std::vector<Entry *, malloc_allocator<Entry *>> dirty;
+    for (int now_stripe = 0; now_stripe < STRIPES; now_stripe++)
     {
-        if (pointers->pointers[now] == 0)
+        MutexLock _(locks[now_stripe]);
+        dirty.clear();
+        for (int now_set = now_stripe * SETS_PER_STRIPE; now_set < (now_stripe + 1) * SETS_PER_STRIPE; now_set++)
+            for (auto &&entry : entries[now_set])
+                if (entry.valid && entry.dirty)
+                    dirty.push_back(&entry);
+        std::sort(dirty.begin(), dirty.end(), [](Entry *a, Entry *b) { return a->inodeno < b->inodeno; });
+        count += dirty.size();
+
+        for (auto now = dirty.begin(); now != dirty.end();)
         {
-            if (now != 0)
+            int index = (*now)->inodeno / INodeBlock::INODE_IN_BLOCK;
+            auto block = Disk::from_blockno<INodeBlock>(Disk::header().inode_block(index * INodeBlock::INODE_IN_BLOCK));
+            if (block)
             {
-                // Check prev block;
-                now--;
-                now_block -= PointerBlock::POINTER_PER_BLOCK;
-                auto block_to_check = pointers->pointers[now];
-                pointers.~BlockProxy();
-                new (&pointers) BlockProxy<PointerBlock>(block_to_check);
-                pointers.drop();
-                for (auto &&pointer : pointers->pointers)
-                {
-                    if (pointer == 0)
-                        break;
-                    now_block++;
-                }
+                err = EIO;
+                while (now != dirty.end() && (*now)->inodeno / INodeBlock::INODE_IN_BLOCK == index)
+                    now++;
+                continue;
             }
-            goto BLOCK_COUNT_END;
+            for (; now != dirty.end() && (*now)->inodeno / INodeBlock::INODE_IN_BLOCK == index; now++)
+            {
+                block->inodes[(*now)->inodeno % INodeBlock::INODE_IN_BLOCK] = (*now)->inode;
+                (*now)->dirty = false;
+            }
+            block.commit();
+            if (block)
+                err = EIO;
         }
-        else
+    }
+    Debug << Show(count) << Show(err);
+    return err;
+}
+
+INodeProxy::INodeProxy(int inodeno)
+    : inodeno(inodeno)
+{
+    error = INodeCache::get(inodeno, inode);
+    Debug << Show(inodeno) << Show(error);
+}
+
+bool INodeProxy::access()
+{
+    uint32_t now = time(NULL);
+    if (options.atime == Options::NOATIME)
+        return false;
+    if (options.atime == Options::RELATIME && inode.atime > inode.mtime && inode.atime > inode.ctime &&
+        now - inode.atime < 24 * 60 * 60)
+        return false;
+    inode.atime = now;
+    return true;
+}
+
+void INodeProxy::apply()
+{
+    error = INodeCache::put(inodeno, inode);
+    Debug << Show(inodeno) << Show(error);
+}
+
+// Blocks are allocated as a strict prefix, so filesize alone gives the count
+inline int DataProxy::get_block_size()
+{
+    size_t filesize = INodeProxy(inodeno).drop()->filesize;
+    return is_inline(filesize) ? 0 : (filesize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+int DataProxy::resize(size_t size, size_t written)
+{
+    if (size > MAX_SIZE)
+        return EFBIG;
+    size_t size_orig = INodeProxy(inodeno).drop()->filesize;
+    if (!is_inline(size_orig) && !is_inline(size))
+    {
+        // The last block still holds what a shrink cut off
+        size_t tail_end = std::min((size_orig + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE, size - std::min(written, size));
+        if (tail_end > size_orig)
+        {
+            auto block = Disk::from_blockno<DataBlock>(get_data_block(size_orig / BLOCK_SIZE));
+            memset(block->data + size_orig % BLOCK_SIZE, 0, tail_end - size_orig);
+            block.commit();
+        }
+        return resize_blocks(size, written);
+    }
+
+    char data[INodeBlock::INLINE_SIZE];
+    if (is_inline(size_orig) && !is_inline(size))
+    {
+        // Move the data out to a first block
+        {
+            auto inode = INodeProxy(inodeno);
+            memcpy(data, inode->inline_data, size_orig);
+            memset(inode->inline_data, 0, sizeof(inode->inline_data));
+            inode->filesize = 0;
+            inode.commit();
+        }
+        if (int err = resize_blocks(size, written))
         {
-            now_block += PointerBlock::POINTER_PER_BLOCK;
+            auto inode = INodeProxy(inodeno);
+            memcpy(inode->inline_data, data, size_orig);
+            inode->filesize = size_orig;
+            inode.commit();
+            return err;
         }
+        auto block = Disk::from_blockno<DataBlock>(get_data_block(0), overwrite);
+        memcpy(block->data, data, size_orig);
+        memset(block->data + size_orig, 0, BLOCK_SIZE - size_orig);
+        block.commit();
+        return 0;
+    }
+    bool demote = !is_inline(size_orig);
+    if (demote)
+    {
+        // Take the data back in and free every block
+        load(0, size, data);
+        resize_blocks(0);
     }
-    goto BLOCK_COUNT_END;
 
-BLOCK_COUNT_END:
-    return now_block;
+    auto inode = INodeProxy(inodeno);
+    if (demote)
+        memcpy(inode->inline_data, data, size);
+    else if (size > size_orig)
+        memset(inode->inline_data + size_orig, 0, size - size_orig);
+    else
+        memset(inode->inline_data + size, 0, size_orig - size);
+    inode->filesize = size;
+    inode->ctime = time(NULL);
+    inode.commit();
+    return 0;
 }
 
-int DataProxy::resize(size_t size)
+int DataProxy::resize_blocks(size_t size, size_t written)
 {
     int block_need = std::max<int>(0, (size + BLOCK_SIZE - 1) / BLOCK_SIZE); // ceil
     int block_now = get_block_size();
@@ -836,13 +3671,50 @@ int DataProxy::resize(size_t size)
 
     size_t size_orig = inode->filesize;
 
+    // Hand out blocks from contiguous runs, asking for everything still missing
+    // at once, right after the last block or else in the group of the inode
+    int run_start = Disk::header().inode_block(inodeno), run_left = 0;
+    if (block_now && block_need > block_now)
+        run_start = get_data_block(block_now - 1) + 1;
+    auto take = [&]() {
+        if (run_left == 0 && (run_start = Disk::alloc_data_run(block_need - block_now, run_left, run_start)) == -1)
+            return -1;
+        run_left--;
+        return run_start++;
+    };
+    // A new data block comes as the file that used it last left it; cleared
+    // in the cache, unread, unless the caller's write covers it
+    size_t written_from = size - std::min(written, size);
+    auto take_data = [&]() {
+        int data = take();
+        if (data != -1 && size_t(block_now) * BLOCK_SIZE < written_from)
+        {
+            auto block = Disk::from_blockno<DataBlock>(data, overwrite);
+            memset(&*block, 0, BLOCK_SIZE);
+            block.commit();
+        }
+        return data;
+    };
+    // Fill pointers [from, to) of a pointer block, returns where it stopped
+    auto fill = [&](BlockProxy<PointerBlock> &block, int from, int to) {
+        for (; from < to; from++)
+        {
+            int data = take_data();
+            if (data == -1)
+                break;
+            block->pointers[from] = data;
+            block_now++;
+        }
+        return from;
+    };
+
     while (block_now != block_need)
     {
         if (block_now < block_need)
         {
             if (block_now < 1)
             {
-                int data = Disk::alloc_data();
+                int data = take_data();
                 if (data == -1)
                     goto ROLLBACK;
                 else
@@ -857,19 +3729,20 @@ int DataProxy::resize(size_t size)
                 int offset = block_now - 1;
                 if (offset == 0)
                 {
-                    int data = Disk::alloc_data();
+                    int data = take();
                     if (data == -1)
                         goto ROLLBACK;
-                    auto ind_block = Disk::from_blockno<PointerBlock>(data);
+                    auto ind_block = Disk::from_blockno<PointerBlock>(data, overwrite);
                     memset(&*ind_block, 0, BLOCK_SIZE);
                     ind_block.commit();
                     inode->indirect_pointer = data;
                     extend_ind = true;
                 }
                 auto ind_block = Disk::from_blockno<PointerBlock>(inode->indirect_pointer);
-                int data = Disk::alloc_data();
-                if (data == -1)
+                int filled = fill(ind_block, offset, std::min(block_need - 1, PointerBlock::POINTER_PER_BLOCK));
+                if (filled == offset)
                 {
+                    ind_block.drop();
                     if (extend_ind)
                     {
                         Disk::free_data(inode->indirect_pointer);
@@ -877,9 +3750,9 @@ int DataProxy::resize(size_t size)
                     }
                     goto ROLLBACK;
                 }
-                ind_block->pointers[offset] = data;
                 ind_block.commit();
-                block_now++;
+                if (block_now != block_need && filled != PointerBlock::POINTER_PER_BLOCK)
+                    goto ROLLBACK;
             }
             else
             {
@@ -893,17 +3766,17 @@ int DataProxy::resize(size_t size)
                 {
                     if (id_ind == 0)
                     {
-                        int data = Disk::alloc_data();
+                        int data = take();
                         if (data == -1)
                             goto ROLLBACK;
-                        auto iind_block = Disk::from_blockno<PointerBlock>(data);
+                        auto iind_block = Disk::from_blockno<PointerBlock>(data, overwrite);
                         memset(&*iind_block, 0, BLOCK_SIZE);
                         iind_block.commit();
                         inode->iindirect_pointer = data;
                         extend_iind = true;
                     }
                     auto iind_block = Disk::from_blockno<PointerBlock>(inode->iindirect_pointer);
-                    int data = Disk::alloc_data();
+                    int data = take();
                     if (data == -1)
                     {
                         iind_block.drop();
@@ -914,7 +3787,7 @@ int DataProxy::resize(size_t size)
                         }
                         goto ROLLBACK;
                     }
-                    auto ind_block = Disk::from_blockno<PointerBlock>(data);
+                    auto ind_block = Disk::from_blockno<PointerBlock>(data, overwrite);
                     memset(&*ind_block, 0, BLOCK_SIZE);
                     ind_block.commit();
                     iind_block->pointers[id_ind] = data;
@@ -925,8 +3798,10 @@ int DataProxy::resize(size_t size)
                 auto iind_block = Disk::from_blockno<PointerBlock>(inode->iindirect_pointer);
                 auto ind_block = Disk::from_blockno<PointerBlock>(iind_block->pointers[id_ind]);
 
-                int data = Disk::alloc_data();
-                if (data == -1)
+                int last = std::min(block_need - (1 + PointerBlock::POINTER_PER_BLOCK) - id_ind * PointerBlock::POINTER_PER_BLOCK,
+                                    PointerBlock::POINTER_PER_BLOCK);
+                int filled = fill(ind_block, id_offset, last);
+                if (filled == id_offset)
                 {
                     ind_block.drop();
                     if (extend_ind)
@@ -943,14 +3818,15 @@ int DataProxy::resize(size_t size)
                     goto ROLLBACK;
                 }
                 iind_block.drop();
-                ind_block->pointers[id_offset] = data;
                 ind_block.commit();
-                block_now++;
+                if (block_now != block_need && filled != PointerBlock::POINTER_PER_BLOCK)
+                    goto ROLLBACK;
             }
         }
         else if (block_now > block_need)
         {
             int block_to_shrink = block_now - 1;
+            BlockMap::forget(inodeno, block_to_shrink);
             if (block_to_shrink < 1)
             {
                 Disk::free_data(inode->direct_pointer);
@@ -1000,18 +3876,29 @@ int DataProxy::resize(size_t size)
             }
         }
     }
+    assert(run_left == 0);
     inode->filesize = size;
     inode.commit();
     Debug << Show(inode->filesize);
     return 0;
 ROLLBACK:
     Error << "Rolling back";
+    inode->filesize = block_now * BLOCK_SIZE; // keep get_block_size in step with what is allocated
     inode.commit();
-    resize(size_orig);
+    resize_blocks(size_orig);
     return ENOSPC;
 }
 
 int DataProxy::get_data_block(int datano)
+{
+    if (int blockno = BlockMap::lookup(inodeno, datano))
+        return blockno;
+    int blockno = map_data_block(datano);
+    BlockMap::insert(inodeno, datano, blockno);
+    return blockno;
+}
+
+int DataProxy::map_data_block(int datano)
 {
     auto inode = INodeProxy(inodeno);
     inode.drop(); //Read only
@@ -1037,19 +3924,19 @@ int DataProxy::get_data_block(int datano)
 
     if (datano < now_block + PointerBlock::POINTER_PER_BLOCK)
     {
-        auto pointer = Disk::from_blockno<PointerBlock>(inode->indirect_pointer).drop();
+        auto pointer = Disk::from_blockno<const PointerBlock>(inode->indirect_pointer);
         assert(pointer->pointers[datano - now_block]);
         return pointer->pointers[datano - now_block];
     }
     now_block += PointerBlock::POINTER_PER_BLOCK;
 
     assert(inode->iindirect_pointer);
-    auto ipointer = Disk::from_blockno<PointerBlock>(inode->iindirect_pointer).drop();
+    auto ipointer = Disk::from_blockno<const PointerBlock>(inode->iindirect_pointer);
     auto offset0 = datano - now_block;
     auto id_ind = offset0 / PointerBlock::POINTER_PER_BLOCK;
     auto id_offset = offset0 % PointerBlock::POINTER_PER_BLOCK;
     assert(ipointer->pointers[id_ind]);
-    auto pointer = Disk::from_blockno<PointerBlock>(ipointer->pointers[id_ind]).drop();
+    auto pointer = Disk::from_blockno<const PointerBlock>(ipointer->pointers[id_ind]);
     assert(pointer->pointers[id_offset]);
     return pointer->pointers[id_offset];
 }
@@ -1058,10 +3945,25 @@ size_t DataProxy::read(size_t offset, size_t size, void *target)
 {
     Debug << Show(offset) << Show(size);
     auto inode = INodeProxy(inodeno);
-    inode->atime = time(NULL);
-    inode.commit(); // update access time
+    if (inode.access())
+        inode.commit(); // update access time
+    else
+        inode.drop();
+    return load(offset, size, target);
+}
 
-    size = std::min<size_t>(offset + size, inode->filesize) - offset;
+size_t DataProxy::load(size_t offset, size_t size, void *target)
+{
+    auto inode = INodeProxy(inodeno).drop();
+    size_t filesize = inode->filesize;
+    if (offset >= filesize)
+        return 0;
+    size = std::min<size_t>(offset + size, filesize) - offset;
+    if (is_inline(filesize))
+    {
+        memcpy(target, inode->inline_data + offset, size);
+        return size;
+    }
     auto ret = size;
 
     while (size)
@@ -1069,9 +3971,21 @@ size_t DataProxy::read(size_t offset, size_t size, void *target)
         size_t datano = offset / BLOCK_SIZE;
         int block_no = get_data_block(datano);
         size_t offset_in_block = offset % BLOCK_SIZE;
-        size_t bytes_to_read = std::min<size_t>(size, BLOCK_SIZE);
+        size_t bytes_to_read = std::min<size_t>(size, BLOCK_SIZE - offset_in_block);
 
-        auto datablock = Disk::from_blockno<DataBlock>(block_no).drop(); // read-only
+        if (bytes_to_read == BLOCK_SIZE)
+        {
+            int count = run(datano, block_no, size / BLOCK_SIZE);
+            if (Disk::read_run(block_no, count, static_cast<char *>(target)))
+                return ret - size;
+            bytes_to_read = size_t(count) * BLOCK_SIZE;
+            size -= bytes_to_read;
+            offset += bytes_to_read;
+            target = (char *)target + bytes_to_read;
+            continue;
+        }
+
+        auto datablock = Disk::from_blockno<const DataBlock>(block_no);
         memcpy(target, datablock->data + offset_in_block, bytes_to_read);
         size -= bytes_to_read;
         offset += bytes_to_read;
@@ -1086,13 +4000,16 @@ size_t DataProxy::write(size_t offset, size_t size, const void *target)
     Debug << Show(offset) << Show(size);
     auto inode = INodeProxy(inodeno);
     inode->mtime = time(NULL);
-    inode.commit(); // update modify time
-
     if (offset + size > inode->filesize)
     {
         Error << Show(offset + size > inode->filesize);
         size = inode->filesize - offset;
     }
+    if (is_inline(inode->filesize))
+        memcpy(inode->inline_data + offset, target, size);
+    inode.commit(); // update modify time
+    if (is_inline(inode->filesize))
+        return size;
     auto ret = size;
 
     while (size)
@@ -1100,7 +4017,20 @@ size_t DataProxy::write(size_t offset, size_t size, const void *target)
         size_t datano = offset / BLOCK_SIZE;
         int block_no = get_data_block(datano);
         size_t offset_in_block = offset % BLOCK_SIZE;
-        size_t bytes_to_write = std::min<size_t>(size, BLOCK_SIZE);
+        size_t bytes_to_write = std::min<size_t>(size, BLOCK_SIZE - offset_in_block);
+
+        // Whole blocks are replaced without reading what they held
+        if (bytes_to_write == BLOCK_SIZE)
+        {
+            int count = run(datano, block_no, size / BLOCK_SIZE);
+            if (Disk::write_run(block_no, count, static_cast<const char *>(target)))
+                return ret - size;
+            bytes_to_write = size_t(count) * BLOCK_SIZE;
+            size -= bytes_to_write;
+            offset += bytes_to_write;
+            target = (char *)target + bytes_to_write;
+            continue;
+        }
 
         auto datablock = Disk::from_blockno<DataBlock>(block_no);
         memcpy(datablock->data + offset_in_block, target, bytes_to_write);
@@ -1113,42 +4043,383 @@ size_t DataProxy::write(size_t offset, size_t size, const void *target)
     return ret;
 }
 
-int DirectoryProxy::length() { return INodeProxy(inodeno).drop()->filesize / sizeof(Item); }
+int DataProxy::run(int datano, int blockno, int limit)
+{
+    limit = std::min(limit, Disk::RUN_MAX);
+    int count = 1;
+    while (count < limit && get_data_block(datano + count) == blockno + count)
+        count++;
+    return count;
+}
 
-void DirectoryProxy::set(int index, DirectoryProxy::Item item)
+void DataProxy::readahead(int first, int count)
 {
-    assert(index < length());
-    DataProxy data(inodeno);
-    data.write(index * sizeof(Item), sizeof(Item), &item);
+    if (Disk::mapped())
+        return; // the kernel reads ahead in the mapped image
+    int blocks[OpenFile::READAHEAD_MAX];
+    int end = std::min(first + std::min(count, OpenFile::READAHEAD_MAX), get_block_size());
+    for (int datano = first; datano < end; datano++)
+        blocks[datano - first] = get_data_block(datano);
+    if (end > first)
+        Readahead::submit(blocks, end - first);
 }
 
-DirectoryProxy::Item DirectoryProxy::get(int index)
+int DirectoryProxy::size() { return INodeProxy(inodeno).drop()->filesize; }
+
+// Bytes taken by the records at the start of data
+int DirectoryProxy::used(const char *data, int size)
+{
+    int offset = 0;
+    while (offset + MIN_ITEM <= size)
+    {
+        auto item = reinterpret_cast<const Item *>(data + offset);
+        if (item->name_length == 0)
+            break;
+        offset += item->size();
+    }
+    return offset;
+}
+
+void DirectoryProxy::iterator::load()
+{
+    auto inode = INodeProxy(inodeno).drop();
+    if ((inlined = DataProxy::is_inline(inode->filesize)))
+    {
+        memcpy(inline_data, inode->inline_data, sizeof(inline_data));
+        return;
+    }
+    block.~BlockProxy();
+    new (&block) BlockProxy<const DataBlock>(DataProxy(inodeno).get_data_block(offset / BLOCK_SIZE));
+}
+
+// Moves on to the next record, past the end of each block's records
+void DirectoryProxy::iterator::settle()
+{
+    while (offset < limit)
+    {
+        int in_block = offset % BLOCK_SIZE;
+        int end = inlined ? limit : BLOCK_SIZE;
+        if (in_block + MIN_ITEM <= end && (**this).name_length)
+            return;
+        if (inlined)
+        {
+            offset = limit;
+            return;
+        }
+        offset = (offset / BLOCK_SIZE + 1) * BLOCK_SIZE;
+        if (offset < limit)
+            load();
+    }
+}
+
+DirectoryProxy::Item DirectoryProxy::get(int position)
 {
-    assert(index < length());
-    DataProxy data(inodeno);
     Item ret;
-    data.read(index * sizeof(Item), sizeof(Item), &ret);
+    iterator it(inodeno, position, size());
+    auto &&item = *it;
+    memcpy(&ret, &item, item.size());
     return ret;
 }
 
-int DirectoryProxy::push(DirectoryProxy::Item item)
+int DirectoryProxy::find(const char *filename)
+{
+    if (int index_no = index_inode())
+        return index_find(index_no, filename);
+
+    uint32_t hash = DirectoryProxy::hash(filename);
+    for (auto it = begin(), end = this->end(); it != end; ++it)
+        if (it->is(hash, filename))
+            return it.position();
+    return -1;
+}
+
+// Appends to the last block, or to a new one when it is full
+int DirectoryProxy::push(const DirectoryProxy::Item &item)
 {
-    int length = this->length();
-    int file_length = (length + 1) * sizeof(Item);
+    int size = this->size(), item_size = item.size();
     DataProxy data(inodeno);
+    int used = size;
+    if (DataProxy::is_inline(size))
+    {
+        if (size + item_size <= INodeBlock::INLINE_SIZE)
+        {
+            if (auto err = data.resize(size + item_size))
+                return err;
+            data.write(size, item_size, &item);
+            return 0;
+        }
+        // Out of the inode into a first block, the records stay where they were
+        if (auto err = data.resize(BLOCK_SIZE))
+            return err;
+        size = BLOCK_SIZE;
+    }
+    else
+    {
+        char last[BLOCK_SIZE];
+        data.load(size - BLOCK_SIZE, BLOCK_SIZE, last);
+        used = DirectoryProxy::used(last, BLOCK_SIZE);
+    }
 
-    auto err = data.resize(file_length);
-    if (err)
-        return err;
-    this->set(length, item);
+    int blockno = size / BLOCK_SIZE - 1;
+    if (used + item_size <= BLOCK_SIZE)
+        data.write(blockno * BLOCK_SIZE + used, item_size, &item);
+    else
+    {
+        if (auto err = data.resize(size + BLOCK_SIZE, BLOCK_SIZE))
+            return err;
+        char block[BLOCK_SIZE] = {};
+        memcpy(block, &item, item_size);
+        data.write(size, BLOCK_SIZE, block);
+        blockno++;
+    }
+
+    int index_no = index_inode();
+    if (index_no == 0 ? blockno + 1 > INDEX_THRESHOLD : (index_entries(index_no) + 1) * 2 > index_capacity(index_no))
+        index_rebuild();
+    else if (index_no)
+    {
+        index_insert(index_no, item.hash, blockno + 1);
+        index_count(index_no, 1);
+    }
     return 0;
 }
 
-void DirectoryProxy::erase(int index)
+// Closes the gap left in the record's block, then folds the last block into
+// it when both fit in one, and takes a directory that fits back inline
+void DirectoryProxy::erase(int position)
 {
-    int length = this->length();
-    auto last = this->get(length - 1);
-    this->set(index, last);
+    int size = this->size();
     DataProxy data(inodeno);
-    assert(!data.resize((length - 1) * sizeof(Item)));
+    if (DataProxy::is_inline(size))
+    {
+        char records[INodeBlock::INLINE_SIZE];
+        data.load(0, size, records);
+        int item_size = reinterpret_cast<const Item *>(records + position)->size();
+        data.write(position, size - position - item_size, records + position + item_size);
+        assert(!data.resize(size - item_size));
+        return;
+    }
+
+    int blockno = position / BLOCK_SIZE, last = size / BLOCK_SIZE - 1, offset = position % BLOCK_SIZE;
+    char block[BLOCK_SIZE];
+    data.load(blockno * BLOCK_SIZE, BLOCK_SIZE, block);
+    auto item = reinterpret_cast<const Item *>(block + offset);
+    int item_size = item->size();
+    int index_no = index_inode();
+    if (index_no)
+    {
+        index_erase(index_no, item->hash, blockno + 1);
+        index_count(index_no, -1);
+    }
+    memmove(block + offset, block + offset + item_size, BLOCK_SIZE - offset - item_size);
+    memset(block + BLOCK_SIZE - item_size, 0, item_size);
+    int used = DirectoryProxy::used(block, BLOCK_SIZE);
+
+    bool drop_last = used == 0 && blockno == last;
+    if (blockno != last)
+    {
+        char tail[BLOCK_SIZE];
+        data.load(last * BLOCK_SIZE, BLOCK_SIZE, tail);
+        int tail_used = DirectoryProxy::used(tail, BLOCK_SIZE);
+        if ((drop_last = used + tail_used <= BLOCK_SIZE))
+        {
+            for (int i = 0; i < tail_used; i += reinterpret_cast<const Item *>(tail + i)->size())
+                if (index_no)
+                    index_move(index_no, reinterpret_cast<const Item *>(tail + i)->hash, last + 1, blockno + 1);
+            memcpy(block + used, tail, tail_used);
+            used += tail_used;
+        }
+        data.write(blockno * BLOCK_SIZE, BLOCK_SIZE, block);
+    }
+    else if (!drop_last)
+        data.write(blockno * BLOCK_SIZE, BLOCK_SIZE, block);
+    if (drop_last)
+    {
+        assert(!data.resize(last * BLOCK_SIZE));
+        size -= BLOCK_SIZE;
+    }
+
+    if (size / BLOCK_SIZE <= INDEX_THRESHOLD / 2)
+        remove_index();
+    if (size == BLOCK_SIZE)
+    {
+        if (blockno != 0)
+        {
+            data.load(0, BLOCK_SIZE, block);
+            used = DirectoryProxy::used(block, BLOCK_SIZE);
+        }
+        if (DataProxy::is_inline(used))
+            assert(!data.resize(used));
+    }
+}
+
+void DirectoryProxy::remove_index()
+{
+    auto inode = INodeProxy(inodeno);
+    int index_no = inode->index_inode;
+    if (index_no == 0)
+    {
+        inode.drop();
+        return;
+    }
+    inode->index_inode = 0;
+    inode.commit();
+    DataProxy(index_no).resize(0);
+    Disk::free_inode(index_no);
+}
+
+int DirectoryProxy::index_inode()
+{
+    return INodeProxy(inodeno).drop()->index_inode;
+}
+
+int DirectoryProxy::index_capacity(int index)
+{
+    return INodeProxy(index).drop()->filesize / sizeof(IndexSlot);
+}
+
+int DirectoryProxy::index_entries(int index)
+{
+    return INodeProxy(index).drop()->index_entries;
+}
+
+void DirectoryProxy::index_count(int index, int delta)
+{
+    auto inode = INodeProxy(index);
+    inode->index_entries += delta;
+    inode.commit();
+}
+
+DirectoryProxy::IndexSlot DirectoryProxy::index_get(int index, int slot)
+{
+    auto block = Disk::from_blockno<const DataBlock>(DataProxy(index).get_data_block(slot / INDEX_SLOT_IN_BLOCK));
+    return reinterpret_cast<const IndexSlot *>(block->data)[slot % INDEX_SLOT_IN_BLOCK];
+}
+
+void DirectoryProxy::index_set(int index, int slot, IndexSlot value)
+{
+    auto block = Disk::from_blockno<DataBlock>(DataProxy(index).get_data_block(slot / INDEX_SLOT_IN_BLOCK));
+    reinterpret_cast<IndexSlot *>(block->data)[slot % INDEX_SLOT_IN_BLOCK] = value;
+    block.commit();
+}
+
+int DirectoryProxy::index_find(int index, const char *filename)
+{
+    uint32_t hash = DirectoryProxy::hash(filename);
+    int mask = index_capacity(index) - 1;
+    for (int slot = hash & mask;; slot = (slot + 1) & mask)
+    {
+        auto now = index_get(index, slot);
+        if (now.position == 0)
+            return -1;
+        if (now.hash != hash)
+            continue;
+        // The name could be any one in the block
+        int blockno = now.position - 1;
+        auto block = Disk::from_blockno<const DataBlock>(DataProxy(inodeno).get_data_block(blockno));
+        for (int offset = 0; offset + MIN_ITEM <= BLOCK_SIZE;)
+        {
+            auto item = reinterpret_cast<const Item *>(block->data + offset);
+            if (item->name_length == 0)
+                break;
+            if (item->is(hash, filename))
+                return blockno * BLOCK_SIZE + offset;
+            offset += item->size();
+        }
+    }
+}
+
+int DirectoryProxy::index_slot(int index, uint32_t hash, uint32_t position)
+{
+    int mask = index_capacity(index) - 1;
+    for (int slot = hash & mask;; slot = (slot + 1) & mask)
+    {
+        auto now = index_get(index, slot);
+        if (now.position == 0)
+            return -1;
+        if (now.hash == hash && now.position == position)
+            return slot;
+    }
+}
+
+void DirectoryProxy::index_insert(int index, uint32_t hash, uint32_t position)
+{
+    int mask = index_capacity(index) - 1;
+    int slot = hash & mask;
+    while (index_get(index, slot).position)
+        slot = (slot + 1) & mask;
+    index_set(index, slot, {hash, position});
+}
+
+void DirectoryProxy::index_erase(int index, uint32_t hash, uint32_t position)
+{
+    int mask = index_capacity(index) - 1;
+    int hole = index_slot(index, hash, position);
+    assert(hole != -1);
+
+    // Backward shift deletion, keeps every probe sequence unbroken
+    for (int slot = (hole + 1) & mask;; slot = (slot + 1) & mask)
+    {
+        auto now = index_get(index, slot);
+        if (now.position == 0)
+            break;
+        int home = now.hash & mask;
+        bool movable = hole <= slot ? (home <= hole || home > slot) : (home <= hole && home > slot);
+        if (movable)
+        {
+            index_set(index, hole, now);
+            hole = slot;
+        }
+    }
+    index_set(index, hole, {0, 0});
+}
+
+void DirectoryProxy::index_move(int index, uint32_t hash, uint32_t from, uint32_t to)
+{
+    int slot = index_slot(index, hash, from);
+    assert(slot != -1);
+    index_set(index, slot, {hash, to});
+}
+
+// Rebuilds the index with room for twice the entries, dropping it when
+// there is no space left. Returns 0 or ENOSPC.
+int DirectoryProxy::index_rebuild()
+{
+    int length = 0;
+    for (auto it = begin(), end = this->end(); it != end; ++it)
+        length++;
+    int capacity = INDEX_SLOT_IN_BLOCK;
+    while (capacity < length * 4)
+        capacity *= 2;
+    Info << Show(inodeno) << Show(length) << Show(capacity);
+
+    int index_no = index_inode();
+    if (index_no == 0)
+    {
+        index_no = Disk::alloc_inode(inodeno);
+        if (index_no == -1)
+            return ENOSPC;
+        INodeProxy index(index_no);
+        memset(&*index, 0, sizeof(decltype(*index)));
+        index->ctime = index->atime = index->mtime = time(NULL);
+        index->type = INodeBlock::INodeType::DIRECTORY_INDEX;
+        index.commit();
+
+        INodeProxy directory(inodeno);
+        directory->index_inode = index_no;
+        directory.commit();
+    }
+
+    DataProxy data(index_no);
+    if (data.resize(0) || data.resize(capacity * sizeof(IndexSlot))) // every slot empty
+    {
+        remove_index();
+        return ENOSPC;
+    }
+    for (auto it = begin(), end = this->end(); it != end; ++it)
+        index_insert(index_no, it->hash, it.position() / BLOCK_SIZE + 1);
+    auto index = INodeProxy(index_no);
+    index->index_entries = length;
+    index.commit();
+    return 0;
 }